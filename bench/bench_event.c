@@ -0,0 +1,175 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the event hot paths: allocating and freeing events,
+ * inserting events into a queue at sequential and random positions,
+ * converting MIDI bytes into events and passing data through a pipe.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <umidi20.h>
+
+#define	BENCH_NAME "bench_event"
+#include "bench.h"
+
+#define	BENCH_EVENTS 100000
+#define	BENCH_EVENTS_RANDOM 10000	/* without index */
+#define	BENCH_LOOPS 10
+#define	BENCH_BATCH 1024
+#define	BENCH_CONVERT_BYTES (16 * 1000 * 1000)
+#define	BENCH_PIPE_BYTES (64 * 1000 * 1000)
+
+static void
+bench_alloc_free(void)
+{
+	struct umidi20_event *event[BENCH_BATCH];
+	double t0;
+	uint32_t x;
+	uint32_t y;
+
+	t0 = bench_time();
+	for (x = 0; x != BENCH_EVENTS * BENCH_LOOPS / BENCH_BATCH; x++) {
+		for (y = 0; y != BENCH_BATCH; y++)
+			event[y] = umidi20_event_alloc(NULL, 0);
+		for (y = 0; y != BENCH_BATCH; y++)
+			umidi20_event_free(event[y]);
+	}
+	bench_result("alloc_free", (double)x * BENCH_BATCH /
+	    (bench_time() - t0) / 1000000.0, "Mevents/s");
+}
+
+static void
+bench_insert(const char *test, uint32_t num, uint8_t shuffle, uint8_t indexed)
+{
+	static const uint8_t cmd[3] = {0x90, 60, 90};
+	struct umidi20_event_queue queue;
+	struct umidi20_event *event;
+	double delta = 0;
+	double t0;
+	uint32_t x;
+	uint32_t y;
+
+	srandom(1);
+
+	for (x = 0; x != BENCH_LOOPS; x++) {
+		memset(&queue, 0, sizeof(queue));
+		if (indexed)
+			umidi20_event_queue_set_indexed(&queue, 1);
+
+		t0 = bench_time();
+		for (y = 0; y != num; y++) {
+			event = umidi20_event_from_data(cmd, sizeof(cmd), 0);
+			if (event == NULL)
+				break;
+			event->position = shuffle ? (random() % (num * 4)) : y;
+			umidi20_event_queue_insert(&queue, event,
+			    UMIDI20_CACHE_INPUT);
+		}
+		delta += bench_time() - t0;
+
+		umidi20_event_queue_drain(&queue);
+		if (indexed)
+			umidi20_event_queue_set_indexed(&queue, 0);
+	}
+	bench_result(test, (double)num * BENCH_LOOPS / delta / 1000000.0,
+	    "Mevents/s");
+}
+
+static void
+bench_convert(void)
+{
+	static const uint8_t data[] = {
+		0x90, 60, 90, 64, 90, 67, 90,	/* running status */
+		0x80, 60, 0, 0x80, 64, 0, 0x80, 67, 0,
+		0xB0, 7, 100, 0xE0, 0, 64,
+		0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7,
+	};
+	struct umidi20_converter conv;
+	struct umidi20_event *event;
+	double t0;
+	uint32_t x;
+
+	memset(&conv, 0, sizeof(conv));
+
+	t0 = bench_time();
+	for (x = 0; x != BENCH_CONVERT_BYTES; x++) {
+		event = umidi20_convert_to_event(&conv,
+		    data[x % sizeof(data)], 0);
+		umidi20_event_free(event);
+	}
+	bench_result("convert", BENCH_CONVERT_BYTES /
+	    (bench_time() - t0) / 1000000.0, "MB/s");
+
+	umidi20_convert_reset(&conv);
+}
+
+static void
+bench_pipe_callback(void)
+{
+}
+
+static void
+bench_pipe(const char *test, size_t size)
+{
+	struct umidi20_pipe *pipe = NULL;
+	uint8_t buffer[64];
+	uint64_t ts[64];
+	double t0;
+	uint32_t x;
+
+	memset(buffer, 0x90, sizeof(buffer));
+	umidi20_pipe_alloc(&pipe, &bench_pipe_callback);
+
+	t0 = bench_time();
+	for (x = 0; x != BENCH_PIPE_BYTES / size; x++) {
+		umidi20_pipe_write_data_ts(&pipe, buffer, size, x);
+		umidi20_pipe_read_data_ts(&pipe, buffer, ts, size);
+	}
+	bench_result(test, (double)x * size /
+	    (bench_time() - t0) / 1000000.0, "MB/s");
+
+	umidi20_pipe_free(&pipe);
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_alloc_free();
+	bench_insert("insert_sequential", BENCH_EVENTS, 0, 0);
+	bench_insert("insert_random", BENCH_EVENTS_RANDOM, 1, 0);
+	bench_insert("insert_random_indexed", BENCH_EVENTS, 1, 1);
+	bench_convert();
+	/* short messages, as written by the play thread, and bulk data */
+	bench_pipe("pipe_3", 3);
+	bench_pipe("pipe_64", 64);
+
+	return (0);
+}
@@ -0,0 +1,143 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure how the MIDI file saving and loading throughput, in events
+ * per second, scales with the size of the song, from 1K to 10M
+ * events. A smaller maximum number of events can be given as the
+ * first argument.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <umidi20.h>
+
+#define	BENCH_NAME "bench_file"
+#include "bench.h"
+
+#define	BENCH_TRACKS 16
+#define	BENCH_EVENTS_MIN 1000
+#define	BENCH_EVENTS_MAX 10000000
+#define	BENCH_EVENTS_TOTAL 10000000	/* per test, for small songs */
+
+static pthread_mutex_t bench_mtx;
+
+/* returns a song having the given number of key press and release events */
+static struct umidi20_song *
+bench_song(uint32_t events)
+{
+	struct umidi20_song *song;
+	struct umidi20_track *track;
+	struct mid_data d;
+	uint32_t x;
+	uint32_t y;
+
+	song = umidi20_song_alloc(&bench_mtx,
+	    UMIDI20_FILE_FORMAT_TYPE_1, 480, UMIDI20_FILE_DIVISION_TYPE_PPQ);
+	if (song == NULL)
+		return (NULL);
+
+	for (x = 0; x != BENCH_TRACKS; x++) {
+		track = umidi20_track_alloc();
+		if (track == NULL)
+			break;
+		mid_init(&d, track);
+		mid_set_channel(&d, x & 15);
+		for (y = x; y < events / 2; y += BENCH_TRACKS) {
+			mid_set_position(&d, y * 5);
+			mid_key_press(&d, 36 + (y % 48), 90, 20);
+		}
+		umidi20_song_track_add(song, NULL, track, 0);
+	}
+	return (song);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct umidi20_song *song;
+	uint32_t events;
+	uint32_t max = BENCH_EVENTS_MAX;
+	uint32_t loops;
+	uint32_t len;
+	uint32_t x;
+	uint8_t *ptr;
+	char test[32];
+	double t0;
+
+	if (argc > 1)
+		max = strtoul(argv[1], NULL, 0);
+
+	umidi20_mutex_init(&bench_mtx);
+	pthread_mutex_lock(&bench_mtx);
+
+	for (events = BENCH_EVENTS_MIN; events <= max; events *= 10) {
+		loops = BENCH_EVENTS_TOTAL / events;
+		if (loops > 100)
+			loops = 100;
+		else if (loops == 0)
+			loops = 1;
+
+		song = bench_song(events);
+		if (song == NULL) {
+			fprintf(stderr, "Could not create song\n");
+			return (1);
+		}
+
+		t0 = bench_time();
+		for (x = 0; x != loops; x++) {
+			if (umidi20_save_file(song, &ptr, &len) != 0) {
+				fprintf(stderr, "Could not save to memory\n");
+				return (1);
+			}
+			if (x != loops - 1)
+				free(ptr);
+		}
+		snprintf(test, sizeof(test), "save_%u", events);
+		bench_result(test, (double)events * loops /
+		    (bench_time() - t0) / 1000000.0, "Mevents/s");
+
+		umidi20_song_free(song);
+
+		t0 = bench_time();
+		for (x = 0; x != loops; x++)
+			umidi20_song_free(umidi20_load_file(&bench_mtx, ptr, len));
+		snprintf(test, sizeof(test), "load_%u", events);
+		bench_result(test, (double)events * loops /
+		    (bench_time() - t0) / 1000000.0, "Mevents/s");
+
+		printf("# %u events, file size %u bytes, %u loops\n",
+		    events, len, loops);
+		free(ptr);
+	}
+
+	pthread_mutex_unlock(&bench_mtx);
+
+	return (0);
+}
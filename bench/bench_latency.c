@@ -0,0 +1,174 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the end to end play latency, from the scheduled time of an
+ * event until a consumer thread has read the event from the device
+ * pipe. The device is looped back into a pipe owned by this program,
+ * in place of a real MIDI device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <umidi20.h>
+
+#define	BENCH_NAME "bench_latency"
+#include "bench.h"
+
+#define	BENCH_EVENTS 1000
+#define	BENCH_SPACING 2			/* ms between events */
+#define	BENCH_DELAY 100			/* ms until the first event */
+
+static struct umidi20_pipe *bench_pipe;
+static pthread_mutex_t bench_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_cv = PTHREAD_COND_INITIALIZER;
+static uint32_t bench_work;
+static uint32_t bench_num;
+static double bench_late[BENCH_EVENTS];
+
+static void
+bench_callback(void)
+{
+	pthread_mutex_lock(&bench_mtx);
+	bench_work = 1;
+	pthread_cond_signal(&bench_cv);
+	pthread_mutex_unlock(&bench_mtx);
+}
+
+static void *
+bench_consumer(void *arg)
+{
+	uint8_t buffer[16];
+	uint64_t ts[16];
+	uint64_t now;
+	ssize_t len;
+	ssize_t x;
+
+	while (bench_num < BENCH_EVENTS) {
+		pthread_mutex_lock(&bench_mtx);
+		while (bench_work == 0)
+			pthread_cond_wait(&bench_cv, &bench_mtx);
+		bench_work = 0;
+		pthread_mutex_unlock(&bench_mtx);
+
+		while ((len = umidi20_pipe_read_data_ts(&bench_pipe,
+		    buffer, ts, sizeof(buffer))) > 0) {
+			now = umidi20_get_curr_position_fine();
+			/* one timestamp per key press */
+			for (x = 0; x < len; x += 3) {
+				if (bench_num == BENCH_EVENTS)
+					break;
+				bench_late[bench_num++] = (double)(int64_t)(now - ts[x]) *
+				    1000.0 / (1 << UMIDI20_POSITION_FINE_SHIFT);
+			}
+		}
+	}
+	return (NULL);
+}
+
+static int
+bench_compare(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return ((da > db) - (da < db));
+}
+
+int
+main(int argc, char **argv)
+{
+	static const uint8_t cmd[3] = {0x90, 60, 90};
+	struct umidi20_device_stats stats;
+	struct umidi20_config cfg;
+	struct umidi20_event_queue queue;
+	struct umidi20_event *event;
+	uint32_t position;
+	pthread_t td;
+	uint32_t x;
+
+	umidi20_init();
+	umidi20_pipe_alloc(&bench_pipe, &bench_callback);
+
+	umidi20_config_export(&cfg);
+	cfg.cfg_dev[0].play_enabled_cfg = UMIDI20_ENABLED_CFG_DEV;
+	umidi20_config_import(&cfg);
+
+	/* loop the first play device back into our pipe */
+	pthread_mutex_lock(&root_dev.mutex);
+	root_dev.play[0].update = 0;
+	root_dev.play[0].pipe = &bench_pipe;
+	pthread_mutex_unlock(&root_dev.mutex);
+
+	umidi20_start(0, 0x7FFFFFFF, UMIDI20_FLAG_PLAY);
+
+	pthread_create(&td, NULL, &bench_consumer, NULL);
+
+	srandom(1);
+	memset(&queue, 0, sizeof(queue));
+
+	position = umidi20_get_curr_position() -
+	    root_dev.play[0].start_position + BENCH_DELAY;
+
+	for (x = 0; x != BENCH_EVENTS; x++) {
+		event = umidi20_event_from_data(cmd, sizeof(cmd), 0);
+		if (event == NULL)
+			break;
+		event->position = position + x * BENCH_SPACING;
+		event->position_frac = random();
+		UMIDI20_IF_ENQUEUE_LAST(&queue, event);
+	}
+	umidi20_put_queue_batch(0, &queue);
+
+	pthread_join(td, NULL);
+
+	qsort(bench_late, BENCH_EVENTS, sizeof(bench_late[0]), &bench_compare);
+
+	printf("# %u events, %u ms apart\n", BENCH_EVENTS, BENCH_SPACING);
+	bench_result("read_p50", bench_late[BENCH_EVENTS / 2], "us");
+	bench_result("read_p99", bench_late[BENCH_EVENTS * 99 / 100], "us");
+	bench_result("read_max", bench_late[BENCH_EVENTS - 1], "us");
+
+	/* how late the play thread wrote the events */
+	umidi20_get_device_stats(0, &stats);
+	bench_result("write_p50", umidi20_histogram_percentile(&stats.late, 500), "us");
+	bench_result("write_p99", umidi20_histogram_percentile(&stats.late, 990), "us");
+	bench_result("write_max", stats.late.max, "us");
+
+	umidi20_stop(UMIDI20_FLAG_PLAY);
+
+	pthread_mutex_lock(&root_dev.mutex);
+	root_dev.play[0].pipe = NULL;
+	pthread_mutex_unlock(&root_dev.mutex);
+
+	umidi20_pipe_free(&bench_pipe);
+	umidi20_uninit();
+
+	return (0);
+}
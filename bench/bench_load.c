@@ -0,0 +1,156 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the MIDI file loading throughput, in MB/s, from memory,
+ * from a memory mapped file and from a pipe.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include <umidi20.h>
+
+#define	BENCH_NAME "bench_load"
+#include "bench.h"
+
+#define	BENCH_TRACKS 16
+#define	BENCH_NOTES 20000
+#define	BENCH_LOOPS 8
+
+static pthread_mutex_t bench_mtx;
+
+static struct umidi20_song *
+bench_song(void)
+{
+	struct umidi20_song *song;
+	struct umidi20_track *track;
+	struct mid_data d;
+	uint32_t x;
+	uint32_t y;
+
+	song = umidi20_song_alloc(&bench_mtx,
+	    UMIDI20_FILE_FORMAT_TYPE_1, 480, UMIDI20_FILE_DIVISION_TYPE_PPQ);
+	if (song == NULL)
+		return (NULL);
+
+	for (x = 0; x != BENCH_TRACKS; x++) {
+		track = umidi20_track_alloc();
+		if (track == NULL)
+			break;
+		mid_init(&d, track);
+		mid_set_channel(&d, x & 15);
+		for (y = 0; y != BENCH_NOTES; y++) {
+			mid_set_position(&d, y * 25);
+			mid_key_press(&d, 36 + (y % 48), 90, 20);
+		}
+		umidi20_song_track_add(song, NULL, track, 0);
+	}
+	return (song);
+}
+
+static void
+bench_report(const char *what, uint32_t len, double delta)
+{
+	bench_result(what, (double)len * BENCH_LOOPS / delta / 1000000.0,
+	    "MB/s");
+}
+
+int
+main(int argc, char **argv)
+{
+	char path[] = "/tmp/bench_load.XXXXXX";
+	struct umidi20_song *song;
+	uint8_t *ptr;
+	uint32_t len;
+	double t0;
+	int pfd[2];
+	int fd;
+	int x;
+
+	umidi20_mutex_init(&bench_mtx);
+	pthread_mutex_lock(&bench_mtx);
+
+	song = bench_song();
+	if (song == NULL || umidi20_save_file(song, &ptr, &len) != 0) {
+		fprintf(stderr, "Could not create MIDI file\n");
+		return (1);
+	}
+	umidi20_song_free(song);
+
+	fd = mkstemp(path);
+	if (fd < 0 || write(fd, ptr, len) != (ssize_t)len) {
+		fprintf(stderr, "Could not write %s\n", path);
+		return (1);
+	}
+	close(fd);
+
+	printf("# file size %u bytes, %u loops\n", len, BENCH_LOOPS);
+
+	/* load from memory */
+	t0 = bench_time();
+	for (x = 0; x != BENCH_LOOPS; x++)
+		umidi20_song_free(umidi20_load_file(&bench_mtx, ptr, len));
+	bench_report("memory", len, bench_time() - t0);
+
+	/* load from a memory mapped file */
+	t0 = bench_time();
+	for (x = 0; x != BENCH_LOOPS; x++) {
+		fd = open(path, O_RDONLY);
+		umidi20_song_free(umidi20_load_file_fd(&bench_mtx, fd));
+		close(fd);
+	}
+	bench_report("mmap", len, bench_time() - t0);
+
+	/* load from a pipe, one chunk at a time */
+	t0 = bench_time();
+	for (x = 0; x != BENCH_LOOPS; x++) {
+		if (pipe(pfd) != 0)
+			break;
+		if (fork() == 0) {
+			close(pfd[0]);
+			if (write(pfd[1], ptr, len) != (ssize_t)len)
+				_exit(1);
+			_exit(0);
+		}
+		close(pfd[1]);
+		umidi20_song_free(umidi20_load_file_fd(&bench_mtx, pfd[0]));
+		close(pfd[0]);
+		wait(NULL);
+	}
+	bench_report("pipe", len, bench_time() - t0);
+
+	unlink(path);
+	free(ptr);
+
+	pthread_mutex_unlock(&bench_mtx);
+
+	return (0);
+}
@@ -0,0 +1,137 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure how many events per second a number of producer threads
+ * can queue for playback, each producer using its own device or all
+ * producers sharing a single device, while the play and record
+ * thread is consuming the events.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <umidi20.h>
+
+#define	BENCH_NAME "bench_queue"
+#include "bench.h"
+
+#define	BENCH_PRODUCERS_MAX 8
+#define	BENCH_DURATION 0.5		/* seconds */
+
+struct bench_producer {
+	pthread_t td;
+	uint64_t count;
+	uint8_t	device_no;
+};
+
+static volatile int bench_run;
+
+static void *
+bench_producer(void *arg)
+{
+	static const uint8_t cmd[3] = {0x90, 60, 90};
+	struct bench_producer *pp = arg;
+	struct umidi20_event_queue queue;
+	struct umidi20_event *event;
+
+	memset(&queue, 0, sizeof(queue));
+
+	while (bench_run) {
+		event = umidi20_event_from_data(cmd, sizeof(cmd), 0);
+		if (event == NULL)
+			continue;
+		/* due at once, relative to the device start */
+		event->position = umidi20_get_curr_position() -
+		    root_dev.play[pp->device_no].start_position;
+		UMIDI20_IF_ENQUEUE_LAST(&queue, event);
+		umidi20_put_queue_batch(pp->device_no, &queue);
+		pp->count++;
+	}
+	return (NULL);
+}
+
+static void
+bench_run_producers(uint32_t num, uint8_t shared)
+{
+	struct bench_producer prod[BENCH_PRODUCERS_MAX];
+	char test[32];
+	uint64_t total = 0;
+	double t0;
+	double t1;
+	uint32_t x;
+
+	memset(prod, 0, sizeof(prod));
+
+	bench_run = 1;
+	t0 = bench_time();
+
+	for (x = 0; x != num; x++) {
+		prod[x].device_no = shared ? 0 : x;
+		pthread_create(&prod[x].td, NULL, &bench_producer, &prod[x]);
+	}
+
+	usleep(BENCH_DURATION * 1000000);
+	bench_run = 0;
+
+	for (x = 0; x != num; x++) {
+		pthread_join(prod[x].td, NULL);
+		total += prod[x].count;
+	}
+	t1 = bench_time();
+
+	snprintf(test, sizeof(test), "%s_%u",
+	    shared ? "shared" : "distinct", num);
+	bench_result(test, total / (t1 - t0) / 1000.0, "kevents/s");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct umidi20_config cfg;
+	uint32_t x;
+
+	umidi20_init();
+
+	umidi20_config_export(&cfg);
+	for (x = 0; x != BENCH_PRODUCERS_MAX; x++)
+		cfg.cfg_dev[x].play_enabled_cfg = UMIDI20_ENABLED_CFG_DEV;
+	umidi20_config_import(&cfg);
+
+	umidi20_start(0, 0x7FFFFFFF, UMIDI20_FLAG_PLAY);
+
+	for (x = 1; x <= BENCH_PRODUCERS_MAX; x *= 2) {
+		bench_run_producers(x, 0);
+		bench_run_producers(x, 1);
+	}
+
+	umidi20_stop(UMIDI20_FLAG_PLAY);
+	umidi20_uninit();
+
+	return (0);
+}
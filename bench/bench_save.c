@@ -0,0 +1,145 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the MIDI file saving throughput, in MB/s, to memory, to
+ * memory without modifying the song and to a file descriptor.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <umidi20.h>
+
+#define	BENCH_NAME "bench_save"
+#include "bench.h"
+
+#define	BENCH_TRACKS 16
+#define	BENCH_NOTES 20000
+#define	BENCH_LOOPS 8
+
+static pthread_mutex_t bench_mtx;
+
+static struct umidi20_song *
+bench_song(void)
+{
+	struct umidi20_song *song;
+	struct umidi20_track *track;
+	struct mid_data d;
+	uint32_t x;
+	uint32_t y;
+
+	song = umidi20_song_alloc(&bench_mtx,
+	    UMIDI20_FILE_FORMAT_TYPE_1, 480, UMIDI20_FILE_DIVISION_TYPE_PPQ);
+	if (song == NULL)
+		return (NULL);
+
+	for (x = 0; x != BENCH_TRACKS; x++) {
+		track = umidi20_track_alloc();
+		if (track == NULL)
+			break;
+		mid_init(&d, track);
+		mid_set_channel(&d, x & 15);
+		for (y = 0; y != BENCH_NOTES; y++) {
+			mid_set_position(&d, y * 25);
+			mid_key_press(&d, 36 + (y % 48), 90, 20);
+		}
+		umidi20_song_track_add(song, NULL, track, 0);
+	}
+	return (song);
+}
+
+static void
+bench_report(const char *what, uint32_t len, double delta)
+{
+	bench_result(what, (double)len * BENCH_LOOPS / delta / 1000000.0,
+	    "MB/s");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct umidi20_song *song;
+	uint8_t *ptr;
+	uint32_t len = 0;
+	double t0;
+	int fd;
+	int x;
+
+	umidi20_mutex_init(&bench_mtx);
+	pthread_mutex_lock(&bench_mtx);
+
+	song = bench_song();
+	if (song == NULL) {
+		fprintf(stderr, "Could not create song\n");
+		return (1);
+	}
+
+	/* save to memory */
+	t0 = bench_time();
+	for (x = 0; x != BENCH_LOOPS; x++) {
+		if (umidi20_save_file(song, &ptr, &len) != 0) {
+			fprintf(stderr, "Could not save to memory\n");
+			return (1);
+		}
+		free(ptr);
+	}
+	printf("# file size %u bytes, %u loops\n", len, BENCH_LOOPS);
+	bench_report("memory", len, bench_time() - t0);
+
+	/* save to memory, leaving the song as-is */
+	t0 = bench_time();
+	for (x = 0; x != BENCH_LOOPS; x++) {
+		if (umidi20_save_file_flags(song, &ptr, &len,
+		    UMIDI20_SAVE_FLAG_PRESERVE) != 0) {
+			fprintf(stderr, "Could not save to memory\n");
+			return (1);
+		}
+		free(ptr);
+	}
+	bench_report("preserve", len, bench_time() - t0);
+
+	/* save to a file descriptor */
+	fd = open("/dev/null", O_WRONLY);
+	t0 = bench_time();
+	for (x = 0; x != BENCH_LOOPS; x++) {
+		if (umidi20_save_file_fd(song, fd, 0) != 0) {
+			fprintf(stderr, "Could not save to file\n");
+			return (1);
+		}
+	}
+	bench_report("fd", len, bench_time() - t0);
+	close(fd);
+
+	umidi20_song_free(song);
+
+	pthread_mutex_unlock(&bench_mtx);
+
+	return (0);
+}
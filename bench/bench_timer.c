@@ -0,0 +1,110 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the cost of the timers, with many timers registered. The
+ * CPU time used by the process is sampled while the timers run,
+ * giving the cost per millisecond tick and per timer callback.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <umidi20.h>
+
+#define	BENCH_NAME "bench_timer"
+#include "bench.h"
+
+#define	BENCH_TIMERS 1000
+#define	BENCH_DURATION 2		/* seconds */
+
+static uint64_t bench_calls;
+
+static double
+bench_cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0);
+}
+
+static void
+bench_callback(void *arg)
+{
+	__atomic_fetch_add(&bench_calls, 1, __ATOMIC_RELAXED);
+}
+
+int
+main(int argc, char **argv)
+{
+	static uint8_t arg[BENCH_TIMERS];
+	double t0;
+	double c0;
+	double t1;
+	double c1;
+	uint32_t x;
+
+	umidi20_init();
+
+	/* register and unregister */
+	t0 = bench_time();
+	for (x = 0; x != BENCH_TIMERS; x++)
+		umidi20_set_timer(&bench_callback, arg + x, 1000000);
+	for (x = 0; x != BENCH_TIMERS; x++)
+		umidi20_unset_timer(&bench_callback, arg + x);
+	t1 = bench_time();
+	printf("# %u timers\n", BENCH_TIMERS);
+	bench_result("set_unset", (t1 - t0) * 1000000.0 / BENCH_TIMERS, "us");
+
+	/* intervals from 1 to 1000 ms */
+	for (x = 0; x != BENCH_TIMERS; x++)
+		umidi20_set_timer(&bench_callback, arg + x, 1 + (x % 1000));
+
+	sleep(1);
+
+	bench_calls = 0;
+	t0 = bench_time();
+	c0 = bench_cpu();
+	sleep(BENCH_DURATION);
+	c1 = bench_cpu();
+	t1 = bench_time();
+
+	bench_result("callbacks", bench_calls / (t1 - t0), "calls/s");
+	bench_result("cpu_tick", (c1 - c0) * 1000.0 / (t1 - t0), "us");
+	bench_result("cpu_callback", (c1 - c0) * 1000000.0 / bench_calls, "us");
+
+	for (x = 0; x != BENCH_TIMERS; x++)
+		umidi20_unset_timer(&bench_callback, arg + x);
+
+	umidi20_uninit();
+
+	return (0);
+}
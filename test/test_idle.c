@@ -0,0 +1,95 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Check that the play and record thread sleeps, when a play device
+ * has passed its end offset while events are still queued.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <umidi20.h>
+
+#define	TEST_CPU_MAX 0.1		/* seconds, per second */
+
+static double
+test_cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const uint8_t cmd[3] = {0x90, 60, 90};
+	struct umidi20_event_queue queue;
+	struct umidi20_event *event;
+	struct umidi20_config cfg;
+	double c0;
+	double c1;
+
+	umidi20_init();
+
+	umidi20_config_export(&cfg);
+	cfg.cfg_dev[0].play_enabled_cfg = UMIDI20_ENABLED_CFG_DEV;
+	umidi20_config_import(&cfg);
+
+	/* queue an event after the end of the device */
+	umidi20_start(0, 100, UMIDI20_FLAG_PLAY);
+
+	memset(&queue, 0, sizeof(queue));
+	event = umidi20_event_from_data(cmd, sizeof(cmd), 0);
+	if (event == NULL) {
+		fprintf(stderr, "Could not allocate event\n");
+		return (1);
+	}
+	event->position = 200;
+	UMIDI20_IF_ENQUEUE_LAST(&queue, event);
+	umidi20_put_queue_batch(0, &queue);
+
+	/* wait for the time overflow */
+	usleep(300000);
+
+	c0 = test_cpu();
+	sleep(1);
+	c1 = test_cpu();
+
+	umidi20_uninit();
+
+	if (c1 - c0 > TEST_CPU_MAX) {
+		fprintf(stderr, "test_idle: used %.3f s of CPU in 1 s\n", c1 - c0);
+		return (1);
+	}
+	printf("test_idle: ok\n");
+	return (0);
+}
@@ -0,0 +1,152 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * Check that muting a track while the song is playing only removes
+ * the queued events of that track, and keeps the ones stopping a key
+ * and the ones queued by others.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <umidi20.h>
+
+#define	TEST_KEY_A 60
+#define	TEST_KEY_B 62
+#define	TEST_KEY_C 64
+
+static volatile uint32_t test_start[128];
+static volatile uint32_t test_end[128];
+
+static void
+test_callback(uint8_t device_no, void *arg, struct umidi20_event *event,
+    uint8_t *drop)
+{
+	if (umidi20_event_is_key_start(event))
+		test_start[umidi20_event_get_key(event) & 0x7F]++;
+	else if (umidi20_event_is_key_end(event))
+		test_end[umidi20_event_get_key(event) & 0x7F]++;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const uint8_t cmd[3] = {0x90, TEST_KEY_C, 90};
+	struct umidi20_event_queue queue;
+	struct umidi20_config cfg;
+	struct umidi20_song *song;
+	struct umidi20_track *ta;
+	struct umidi20_track *tb;
+	struct umidi20_event *event;
+	struct mid_data d;
+	pthread_mutex_t mtx;
+	uint32_t x;
+	int failed = 0;
+
+	umidi20_init();
+
+	umidi20_config_export(&cfg);
+	cfg.cfg_dev[0].play_enabled_cfg = UMIDI20_ENABLED_CFG_DEV;
+	umidi20_config_import(&cfg);
+
+	umidi20_set_play_event_callback(0, &test_callback, NULL);
+
+	umidi20_mutex_init(&mtx);
+	pthread_mutex_lock(&mtx);
+
+	song = umidi20_song_alloc(&mtx, UMIDI20_FILE_FORMAT_TYPE_0, 500, 0);
+	ta = umidi20_track_alloc();
+	tb = umidi20_track_alloc();
+	if (song == NULL || ta == NULL || tb == NULL) {
+		fprintf(stderr, "Could not allocate song\n");
+		return (1);
+	}
+	umidi20_song_track_add(song, NULL, ta, 0);
+	umidi20_song_track_add(song, NULL, tb, 0);
+
+	/* track B plays long notes, which are muted while sounding */
+	for (x = 0; x != 20; x++) {
+		mid_init(&d, ta);
+		mid_set_position(&d, x * 20);
+		mid_key_press(&d, TEST_KEY_A, 90, 10);
+		mid_init(&d, tb);
+		mid_set_position(&d, x * 20);
+		mid_key_press(&d, TEST_KEY_B, 90, 15);
+	}
+	umidi20_song_set_lookahead(song, 1000);
+	umidi20_song_start(song, 0, 1000, UMIDI20_FLAG_PLAY);
+	pthread_mutex_unlock(&mtx);
+
+	/* queue an event which is not part of the song */
+	memset(&queue, 0, sizeof(queue));
+	event = umidi20_event_from_data(cmd, sizeof(cmd), 0);
+	if (event == NULL) {
+		fprintf(stderr, "Could not allocate event\n");
+		return (1);
+	}
+	event->position = 300;
+	UMIDI20_IF_ENQUEUE_LAST(&queue, event);
+	umidi20_put_queue_batch(0, &queue);
+
+	usleep(105000);
+
+	pthread_mutex_lock(&mtx);
+	umidi20_song_set_mute(song, tb, 1);
+	pthread_mutex_unlock(&mtx);
+
+	usleep(500000);
+
+	pthread_mutex_lock(&mtx);
+	umidi20_song_stop(song, UMIDI20_FLAG_PLAY);
+	umidi20_song_free(song);
+	pthread_mutex_unlock(&mtx);
+
+	umidi20_uninit();
+
+	if (test_start[TEST_KEY_A] != 20 || test_end[TEST_KEY_A] != 20) {
+		fprintf(stderr, "test_mute: track A played %u keys and "
+		    "stopped %u, expected 20\n", test_start[TEST_KEY_A],
+		    test_end[TEST_KEY_A]);
+		failed = 1;
+	}
+	/* no key may be left hanging */
+	if (test_start[TEST_KEY_B] == 0 || test_start[TEST_KEY_B] == 20 ||
+	    test_end[TEST_KEY_B] != 20) {
+		fprintf(stderr, "test_mute: track B played %u keys and "
+		    "stopped %u\n", test_start[TEST_KEY_B],
+		    test_end[TEST_KEY_B]);
+		failed = 1;
+	}
+	if (test_start[TEST_KEY_C] != 1) {
+		fprintf(stderr, "test_mute: queued event was not played\n");
+		failed = 1;
+	}
+	if (failed)
+		return (1);
+	printf("test_mute: ok\n");
+	return (0);
+}
@@ -0,0 +1,131 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * Check that loading a file with packed tracks keeps the memory used
+ * by the events to a few tracks at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <umidi20.h>
+
+#define	TEST_TRACKS 64
+#define	TEST_NOTES 2000
+#define	TEST_EVENTS (TEST_TRACKS * TEST_NOTES * 2)
+
+static uint8_t *
+test_put(uint8_t *ptr, uint32_t value, uint8_t len)
+{
+	while (len--)
+		*ptr++ = value >> (8 * len);
+	return (ptr);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const uint8_t note[8] = {0x00, 0x90, 60, 90, 0x0A, 0x80, 60, 0};
+	struct umidi20_event_stats stats;
+	struct mid_data d;
+	struct umidi20_song *song;
+	struct umidi20_track *track;
+	pthread_mutex_t mtx;
+	uint8_t *file;
+	uint8_t *ptr;
+	uint32_t size;
+	uint32_t x;
+	uint32_t y;
+
+	size = (TEST_NOTES * sizeof(note)) + 4;
+	file = malloc(14 + TEST_TRACKS * (8 + size));
+	if (file == NULL)
+		return (1);
+
+	ptr = file;
+	memcpy(ptr, "MThd", 4);
+	ptr = test_put(ptr + 4, 6, 4);
+	ptr = test_put(ptr, 1, 2);
+	ptr = test_put(ptr, TEST_TRACKS, 2);
+	ptr = test_put(ptr, 480, 2);
+
+	for (x = 0; x != TEST_TRACKS; x++) {
+		memcpy(ptr, "MTrk", 4);
+		ptr = test_put(ptr + 4, size, 4);
+		for (y = 0; y != TEST_NOTES; y++) {
+			memcpy(ptr, note, sizeof(note));
+			ptr += sizeof(note);
+		}
+		memcpy(ptr, "\x00\xFF\x2F\x00", 4);
+		ptr += 4;
+	}
+
+	umidi20_mutex_init(&mtx);
+	pthread_mutex_lock(&mtx);
+
+	song = umidi20_load_file_flags(&mtx, file, ptr - file,
+	    UMIDI20_LOAD_FLAG_PACK);
+	free(file);
+	if (song == NULL || song->queue.ifq_len != TEST_TRACKS) {
+		fprintf(stderr, "Could not load song\n");
+		return (1);
+	}
+
+	x = 0;
+	UMIDI20_QUEUE_FOREACH(track, &(song->queue)) {
+		if (track->packed_num != TEST_NOTES * 2) {
+			fprintf(stderr, "test_pack: track %u has %u packed "
+			    "events\n", x, track->packed_num);
+			return (1);
+		}
+		x++;
+	}
+
+	umidi20_event_get_stats(&stats);
+
+	/* adding events to a packed track unpacks it first */
+	track = song->queue.ifq_head;
+	mid_init(&d, track);
+	mid_key_press(&d, 60, 90, 10);
+
+	if (track->packed != NULL ||
+	    track->queue.ifq_len != (TEST_NOTES * 2) + 2) {
+		fprintf(stderr, "test_pack: %d events after adding "
+		    "to a packed track\n", track->queue.ifq_len);
+		return (1);
+	}
+
+	umidi20_song_free(song);
+	pthread_mutex_unlock(&mtx);
+
+	if (stats.total >= TEST_EVENTS / 2) {
+		fprintf(stderr, "test_pack: %u events allocated for %u "
+		    "packed events\n", stats.total, TEST_EVENTS);
+		return (1);
+	}
+	printf("test_pack: ok\n");
+	return (0);
+}
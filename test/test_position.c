@@ -0,0 +1,169 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * Check that recomputing the positions of the changed events only
+ * gives the same positions as recomputing all positions, when events
+ * having no position yet and tempo events are inserted, also after
+ * saving has changed the resolution of the song.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <umidi20.h>
+
+#define	TEST_EVENTS 16
+
+static int test_failed;
+
+static struct umidi20_event *
+test_event(struct umidi20_track *track, uint32_t tick, uint8_t tempo)
+{
+	static const uint8_t cmd_key[3] = {0x90, 60, 90};
+	static const uint8_t cmd_tempo[5] = {0xFF, 0x51, 0x0F, 0x42, 0x40};
+	struct umidi20_event *event;
+
+	if (tempo)
+		event = umidi20_event_from_data(cmd_tempo, sizeof(cmd_tempo), 0);
+	else
+		event = umidi20_event_from_data(cmd_key, sizeof(cmd_key), 0);
+	if (event == NULL) {
+		fprintf(stderr, "Could not allocate event\n");
+		exit(1);
+	}
+	event->tick = tick;
+
+	/* the position is not known yet */
+	umidi20_event_queue_insert(&(track->queue), event, UMIDI20_CACHE_INPUT);
+	return (event);
+}
+
+static void
+test_check(struct umidi20_song *song, struct umidi20_track *track,
+    const char *what)
+{
+	struct umidi20_event *event;
+	uint32_t pos[TEST_EVENTS + 2];
+	uint32_t n;
+	uint32_t x;
+
+	umidi20_song_recompute_position_dirty(song);
+
+	n = 0;
+	UMIDI20_QUEUE_FOREACH(event, &(track->queue)) {
+		if (n != 0 && pos[n - 1] > event->position) {
+			fprintf(stderr, "test_position: %s: events not sorted\n",
+			    what);
+			test_failed = 1;
+		}
+		pos[n++] = event->position;
+	}
+
+	umidi20_song_recompute_position(song);
+
+	x = 0;
+	UMIDI20_QUEUE_FOREACH(event, &(track->queue)) {
+		if (x == n || pos[x] != event->position) {
+			fprintf(stderr, "test_position: %s: event %u at %u, "
+			    "expected %u\n", what, x, x < n ? pos[x] : 0,
+			    event->position);
+			test_failed = 1;
+			break;
+		}
+		x++;
+	}
+}
+
+static struct umidi20_song *
+test_song(pthread_mutex_t *mtx, uint16_t resolution,
+    struct umidi20_track **pconductor, struct umidi20_track **ptrack)
+{
+	struct umidi20_song *song;
+	uint32_t x;
+
+	song = umidi20_song_alloc(mtx, UMIDI20_FILE_FORMAT_TYPE_1, resolution,
+	    UMIDI20_FILE_DIVISION_TYPE_PPQ);
+	*pconductor = umidi20_track_alloc();
+	*ptrack = umidi20_track_alloc();
+	if (song == NULL || *pconductor == NULL || *ptrack == NULL) {
+		fprintf(stderr, "Could not allocate song\n");
+		exit(1);
+	}
+	umidi20_song_track_add(song, NULL, *pconductor, 0);
+	umidi20_song_track_add(song, NULL, *ptrack, 0);
+
+	for (x = 0; x != TEST_EVENTS; x++)
+		test_event(*ptrack, x * resolution, 0);
+	umidi20_song_recompute_position(song);
+	return (song);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct umidi20_song *song;
+	struct umidi20_track *conductor;
+	struct umidi20_track *track;
+	pthread_mutex_t mtx;
+	uint8_t *ptr;
+	uint32_t len;
+
+	umidi20_mutex_init(&mtx);
+	pthread_mutex_lock(&mtx);
+
+	song = test_song(&mtx, 500, &conductor, &track);
+
+	test_event(track, 1250, 0);
+	test_check(song, track, "insert");
+
+	test_event(conductor, 4000, 1);
+	test_check(song, track, "tempo");
+
+	test_event(conductor, 2000, 1);
+	test_check(song, track, "tempo before");
+
+	umidi20_song_free(song);
+
+	/* saving changes the resolution and the ticks */
+	song = test_song(&mtx, 96, &conductor, &track);
+
+	if (umidi20_save_file(song, &ptr, &len)) {
+		fprintf(stderr, "Could not save song\n");
+		return (1);
+	}
+	free(ptr);
+
+	test_event(track, 1000, 0);
+	test_check(song, track, "save then insert");
+
+	umidi20_song_free(song);
+	pthread_mutex_unlock(&mtx);
+
+	if (test_failed)
+		return (1);
+	printf("test_position: ok\n");
+	return (0);
+}
@@ -0,0 +1,152 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * Check that saving a song without modifying it keeps the tempo
+ * events and the positions of the events.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <umidi20.h>
+
+/* two tracks at 480 PPQ, the tempo goes from 120 to 60 BPM at 500 ms */
+static const uint8_t test_file[] = {
+	'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, 0x01, 0xE0,
+	'M', 'T', 'r', 'k', 0, 0, 0, 19,
+	0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20,
+	0x83, 0x60, 0xFF, 0x51, 0x03, 0x0F, 0x42, 0x40,
+	0x00, 0xFF, 0x2F, 0x00,
+	'M', 'T', 'r', 'k', 0, 0, 0, 29,
+	0x00, 0x90, 60, 90, 0x83, 0x60, 0x80, 60, 0,
+	0x00, 0x90, 62, 90, 0x83, 0x60, 0x80, 62, 0,
+	0x81, 0x70, 0x90, 64, 90,
+	0x00, 0xFF, 0x2F, 0x00,
+};
+
+static const uint32_t test_position[] = {0, 500, 500, 1500, 1700};
+static const uint32_t test_position_normal[] = {0, 500, 500, 1500, 2000};
+
+static int test_failed;
+
+/*
+ * Save the given song preserved and check the positions and the
+ * number of tempo events of the loaded copy.
+ */
+static void
+test_preserve(pthread_mutex_t *mtx, struct umidi20_song *song,
+    const char *what, uint32_t tempo_num, const uint32_t *position)
+{
+	struct umidi20_event *event;
+	uint32_t tempo;
+	uint32_t len;
+	uint32_t x;
+	uint8_t *ptr;
+
+	if (umidi20_save_file_flags(song, &ptr, &len,
+	    UMIDI20_SAVE_FLAG_PRESERVE)) {
+		fprintf(stderr, "Could not save song\n");
+		exit(1);
+	}
+
+	song = umidi20_load_file(mtx, ptr, len);
+	free(ptr);
+	if (song == NULL || song->queue.ifq_len != 2) {
+		fprintf(stderr, "Could not load saved song\n");
+		exit(1);
+	}
+
+	tempo = 0;
+	UMIDI20_QUEUE_FOREACH(event, &(song->queue.ifq_head->queue))
+		tempo += umidi20_event_is_tempo(event);
+	if (tempo != tempo_num) {
+		fprintf(stderr, "test_save: %s: %u tempo events, "
+		    "expected %u\n", what, tempo, tempo_num);
+		test_failed = 1;
+	}
+
+	x = 0;
+	UMIDI20_QUEUE_FOREACH(event, &(song->queue.ifq_tail->queue)) {
+		if (x == 5 || event->position != position[x]) {
+			fprintf(stderr, "test_save: %s: event %u at %u\n",
+			    what, x, event->position);
+			test_failed = 1;
+			break;
+		}
+		x++;
+	}
+	umidi20_song_free(song);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct umidi20_song *song;
+	struct umidi20_event *event;
+	pthread_mutex_t mtx;
+	uint32_t len;
+	uint8_t *ptr;
+
+	umidi20_mutex_init(&mtx);
+	pthread_mutex_lock(&mtx);
+
+	song = umidi20_load_file(&mtx, test_file, sizeof(test_file));
+	if (song == NULL || song->queue.ifq_len != 2) {
+		fprintf(stderr, "Could not load song\n");
+		return (1);
+	}
+
+	/* move the last event, so that its tick must be computed */
+	event = song->queue.ifq_tail->queue.ifq_tail;
+	umidi20_event_set_position_fine(event,
+	    (uint64_t)1700 << UMIDI20_POSITION_FINE_SHIFT);
+
+	test_preserve(&mtx, song, "moved", 2, test_position);
+	umidi20_song_free(song);
+
+	/* saving normally changes the resolution and the ticks */
+	song = umidi20_load_file(&mtx, test_file, sizeof(test_file));
+	if (song == NULL) {
+		fprintf(stderr, "Could not load song\n");
+		return (1);
+	}
+	if (umidi20_save_file(song, &ptr, &len)) {
+		fprintf(stderr, "Could not save song\n");
+		return (1);
+	}
+	free(ptr);
+
+	test_preserve(&mtx, song, "normal then preserve", 0,
+	    test_position_normal);
+	umidi20_song_free(song);
+
+	pthread_mutex_unlock(&mtx);
+
+	if (test_failed)
+		return (1);
+	printf("test_save: ok\n");
+	return (0);
+}
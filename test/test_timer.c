@@ -0,0 +1,73 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * Check that a timer runs at its new interval at once, when the
+ * interval is made shorter without synchronising the timer and
+ * another timer is next to run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <umidi20.h>
+
+static volatile uint32_t test_count;
+
+static void
+test_callback(void *arg)
+{
+	test_count++;
+}
+
+static void
+test_callback_slow(void *arg)
+{
+}
+
+int
+main(int argc, char **argv)
+{
+	umidi20_init();
+
+	umidi20_set_timer(&test_callback_slow, NULL, 1000);
+	umidi20_set_timer(&test_callback, NULL, 10000);
+	umidi20_update_timer(&test_callback, NULL, 20, 0);
+
+	usleep(300000);
+
+	umidi20_unset_timer(&test_callback, NULL);
+	umidi20_unset_timer(&test_callback_slow, NULL);
+	umidi20_uninit();
+
+	if (test_count < 5) {
+		fprintf(stderr, "test_timer: timer ran %u times, "
+		    "expected at least 5\n", test_count);
+		return (1);
+	}
+	printf("test_timer: ok\n");
+	return (0);
+}
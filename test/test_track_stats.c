@@ -0,0 +1,111 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Check that the cached track statistics stay correct, when events
+ * are modified in place and the track is invalidated, followed by
+ * inserting and removing events.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <umidi20.h>
+
+static int test_failed;
+
+static void
+test_range(struct umidi20_track *track, const char *what,
+    uint8_t key_min, uint8_t key_max)
+{
+	umidi20_track_compute_max_min(track);
+
+	if (track->key_min != key_min || track->key_max != key_max) {
+		fprintf(stderr, "test_track_stats: %s: key range %u-%u, "
+		    "expected %u-%u\n", what, track->key_min, track->key_max,
+		    key_min, key_max);
+		test_failed = 1;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct umidi20_track *track;
+	struct umidi20_event *event;
+	struct mid_data d;
+	uint32_t x;
+
+	track = umidi20_track_alloc();
+	if (track == NULL) {
+		fprintf(stderr, "Could not allocate track\n");
+		return (1);
+	}
+	mid_init(&d, track);
+
+	for (x = 0; x != 4; x++) {
+		mid_set_position(&d, x * 100);
+		mid_key_press(&d, 60, 90, 50);
+	}
+	test_range(track, "initial", 60, 60);
+
+	/* transpose in place */
+	UMIDI20_QUEUE_FOREACH(event, &(track->queue))
+		umidi20_event_set_key(event, 72);
+	umidi20_track_invalidate_max_min(track);
+	test_range(track, "transposed", 72, 72);
+
+	/* append an unrelated note */
+	mid_set_position(&d, 1000);
+	mid_key_press(&d, 72, 90, 50);
+	test_range(track, "appended", 72, 72);
+
+	/* remove all events */
+	while (1) {
+		UMIDI20_IF_POLL_HEAD(&(track->queue), event);
+		if (event == NULL)
+			break;
+		umidi20_event_queue_remove(&(track->queue), event);
+		umidi20_event_free(event);
+	}
+	test_range(track, "removed", 60, 60);
+
+	for (x = 0; x != 128; x++) {
+		if (track->stats.key_count[x] != 0) {
+			fprintf(stderr, "test_track_stats: key %u counted "
+			    "%u times in empty track\n", x,
+			    track->stats.key_count[x]);
+			test_failed = 1;
+		}
+	}
+
+	umidi20_track_free(track);
+
+	if (test_failed)
+		return (1);
+	printf("test_track_stats: ok\n");
+	return (0);
+}
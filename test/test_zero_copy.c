@@ -0,0 +1,153 @@
+/*-
+ * Copyright (c) 2022 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * Check that zero copy playback plays all events in order, when the
+ * events of a track which is not next to play are replaced while the
+ * song is playing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <umidi20.h>
+
+#define	TEST_KEY_A 60
+#define	TEST_KEY_B 62
+
+static volatile uint32_t test_count_a;
+static volatile uint32_t test_count_b;
+static volatile uint32_t test_last;
+static volatile int test_failed;
+
+static void
+test_callback(uint8_t device_no, void *arg, struct umidi20_event *event,
+    uint8_t *drop)
+{
+	if (!umidi20_event_is_key_start(event))
+		return;
+	if (event->position < test_last) {
+		fprintf(stderr, "test_zero_copy: event at %u played "
+		    "after %u\n", event->position, test_last);
+		test_failed = 1;
+	}
+	test_last = event->position;
+
+	switch (umidi20_event_get_key(event)) {
+	case TEST_KEY_A:
+		test_count_a++;
+		break;
+	case TEST_KEY_B:
+		test_count_b++;
+		break;
+	default:
+		break;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct umidi20_config cfg;
+	struct umidi20_song *song;
+	struct umidi20_track *ta;
+	struct umidi20_track *tb;
+	struct umidi20_event *event;
+	struct mid_data d;
+	pthread_mutex_t mtx;
+	uint32_t x;
+
+	umidi20_init();
+
+	umidi20_config_export(&cfg);
+	cfg.cfg_dev[0].play_enabled_cfg = UMIDI20_ENABLED_CFG_DEV;
+	umidi20_config_import(&cfg);
+
+	umidi20_set_play_event_callback(0, &test_callback, NULL);
+
+	umidi20_mutex_init(&mtx);
+	pthread_mutex_lock(&mtx);
+
+	song = umidi20_song_alloc(&mtx, UMIDI20_FILE_FORMAT_TYPE_0, 500, 0);
+	ta = umidi20_track_alloc();
+	tb = umidi20_track_alloc();
+	if (song == NULL || ta == NULL || tb == NULL) {
+		fprintf(stderr, "Could not allocate song\n");
+		return (1);
+	}
+	umidi20_song_track_add(song, NULL, ta, 0);
+	umidi20_song_track_add(song, NULL, tb, 0);
+
+	/* track A plays first, track B waits lower in the heap */
+	mid_init(&d, ta);
+	for (x = 0; x != 50; x++) {
+		mid_set_position(&d, x * 10);
+		mid_key_press(&d, TEST_KEY_A, 90, 5);
+	}
+	mid_init(&d, tb);
+	mid_set_position(&d, 450);
+	mid_key_press(&d, TEST_KEY_B, 90, 5);
+
+	umidi20_song_set_zero_copy(song, 1);
+	umidi20_song_start(song, 0, 1000, UMIDI20_FLAG_PLAY);
+	pthread_mutex_unlock(&mtx);
+
+	usleep(100000);
+
+	/* replace the events of track B, freeing the next one to play */
+	pthread_mutex_lock(&mtx);
+	while (1) {
+		UMIDI20_IF_DEQUEUE(&(tb->queue), event);
+		if (event == NULL)
+			break;
+		umidi20_event_free(event);
+	}
+	mid_init(&d, tb);
+	for (x = 0; x != 20; x++) {
+		mid_set_position(&d, 200 + (x * 10));
+		mid_key_press(&d, TEST_KEY_B, 90, 5);
+	}
+	pthread_mutex_unlock(&mtx);
+
+	usleep(700000);
+
+	pthread_mutex_lock(&mtx);
+	umidi20_song_stop(song, UMIDI20_FLAG_PLAY);
+	umidi20_song_free(song);
+	pthread_mutex_unlock(&mtx);
+
+	umidi20_uninit();
+
+	if (test_count_a != 50 || test_count_b != 20) {
+		fprintf(stderr, "test_zero_copy: played %u and %u keys, "
+		    "expected 50 and 20\n", test_count_a, test_count_b);
+		test_failed = 1;
+	}
+	if (test_failed)
+		return (1);
+	printf("test_zero_copy: ok\n");
+	return (0);
+}
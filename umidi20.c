@@ -35,10 +35,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sched.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#ifdef __FreeBSD__
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+#endif
 
 #ifdef __APPLE__
 #include <mach/mach_time.h>
-#include <sched.h>
 static mach_timebase_info_data_t umidi20_timebase_info;
 #endif
 
@@ -61,38 +70,131 @@ static mach_timebase_info_data_t umidi20_timebase_info;
 
 static void *umidi20_watchdog_alloc(void *arg);
 static void *umidi20_watchdog_play_rec(void *arg);
-static void umidi20_watchdog_record_sub(struct umidi20_device *dev, struct umidi20_device *play_dev, uint32_t position);
-static void umidi20_watchdog_play_sub(struct umidi20_device *dev, uint32_t position);
+static void umidi20_watchdog_record_sub(struct umidi20_device *dev, struct umidi20_device *play_dev, uint64_t position_fine);
+static void umidi20_watchdog_play_sub(struct umidi20_device *dev, uint64_t position_fine);
 static void *umidi20_watchdog_files(void *arg);
 static void umidi20_stop_thread(pthread_t *p_td, pthread_mutex_t *mtx);
 static void *umidi20_watchdog_song(void *arg);
-static void umidi20_exec_timer(uint32_t pos);
+static void umidi20_wakeup_init(struct umidi20_wakeup *pw);
+static void umidi20_wakeup_signal(struct umidi20_wakeup *pw);
+static void umidi20_watchdog_play_song(struct umidi20_song *song, struct umidi20_event_queue *copy, uint64_t position_fine);
+static void umidi20_watchdog_play_copy(struct umidi20_event_queue *copy, uint64_t position_fine);
+static void *umidi20_watchdog_timer(void *arg);
+static uint8_t umidi20_event_pool_grow(void);
 
 /* structures */
 
 struct umidi20_root_device root_dev;
 
 struct umidi20_timer_entry {
-	TAILQ_ENTRY(umidi20_timer_entry) entry;
+	LIST_ENTRY(umidi20_timer_entry) entry;
 	umidi20_timer_callback_t *fn;
 	void   *arg;
 	uint32_t ms_interval;
 	uint32_t timeout_pos;
+	uint32_t heap_index;
 	uint8_t	pending;
+	struct umidi20_timer_stats stats;
+};
+
+struct umidi20_thread_start {
+	void   *(*fn) (void *);
+	void   *arg;
+	int	cpu;
+	uint32_t prefault;
+};
+
+static struct {
+	pthread_mutex_t mtx;
+	struct umidi20_rt_config cfg;
+	struct umidi20_rt_status status;
+} umidi20_rt = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Events are carved out of fixed size pages, which are never given
+ * back to the heap. Free events are kept on a singly linked list
+ * using the "p_next" field.
+ */
+struct umidi20_event_page {
+	struct umidi20_event_page *next;
+	struct umidi20_event event[UMIDI20_EVENT_PAGE];
+};
+
+/*
+ * Each thread allocating or freeing events has a private cache of
+ * free events, which is refilled from and drained to the shared pool
+ * in batches, so that the pool lock is only taken once every
+ * UMIDI20_EVENT_CACHE / 2 operations.
+ */
+struct umidi20_event_cache {
+	TAILQ_ENTRY(umidi20_event_cache) entry;
+	struct umidi20_event *free;
+	uint32_t num;
+};
+
+struct umidi20_event_pool {
+	pthread_mutex_t mtx;
+	pthread_once_t once;
+	pthread_key_t key;
+	TAILQ_HEAD(, umidi20_event_cache) caches;
+	struct umidi20_event_page *pages;
+	struct umidi20_event *free;
+	struct umidi20_event_stats stats;
+};
+
+/*
+ * The optional event queue index is a skip list having one node per
+ * distinct position, pointing at the last event having that
+ * position. Events at the same position are ordered in the queue
+ * itself.
+ */
+#define	UMIDI20_INDEX_LEVELS 12
+
+struct umidi20_event_index_node {
+	struct umidi20_event *last;
+	uint32_t position;
+	uint8_t	level;
+	struct umidi20_event_index_node *next[];
+};
+
+struct umidi20_event_index {
+	struct umidi20_event_index_node *next[UMIDI20_INDEX_LEVELS];
+	uint32_t seed;
+};
+
+static struct umidi20_event_pool umidi20_event_pool = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT,
+	.caches = TAILQ_HEAD_INITIALIZER(umidi20_event_pool.caches),
 };
 
 /* functions */
 
+/*
+ * The play and record thread only updates "root_dev.curr_position"
+ * when it wakes up. Compute the current position from the clock
+ * instead.
+ */
 uint32_t
 umidi20_get_curr_position(void)
 {
-	uint32_t position;
+	struct timespec ts;
 
-	pthread_mutex_lock(&root_dev.mutex);
-	position = root_dev.curr_position;
-	pthread_mutex_unlock(&root_dev.mutex);
+	umidi20_gettime(&ts);
+
+	return (umidi20_difftime(&ts, &root_dev.start_time));
+}
+
+uint64_t
+umidi20_get_curr_position_fine(void)
+{
+	struct timespec ts;
 
-	return (position);
+	umidi20_gettime(&ts);
+
+	return (umidi20_difftime_fine(&ts, &root_dev.start_time));
 }
 
 void
@@ -122,7 +224,11 @@ umidi20_init(void)
 
 	umidi20_mutex_init(&root_dev.mutex);
 
-	pthread_cond_init(&root_dev.cond, NULL);
+	pthread_mutex_init(&root_dev.timer_mtx, NULL);
+	pthread_cond_init(&root_dev.timer_cond, NULL);
+
+	umidi20_wakeup_init(&root_dev.wakeup);
+	umidi20_wakeup_init(&root_dev.timer_wakeup);
 
 #ifdef __APPLE__
 	mach_timebase_info(&umidi20_timebase_info);
@@ -130,11 +236,16 @@ umidi20_init(void)
 	umidi20_gettime(&(root_dev.curr_time));
 
 	root_dev.start_time = root_dev.curr_time;
-	root_dev.curr_position = 0;
+	__atomic_store_n(&root_dev.curr_position, 0, __ATOMIC_RELAXED);
 
-	TAILQ_INIT(&root_dev.timers);
+	for (x = 0; x < UMIDI20_TIMER_HASH; x++)
+		LIST_INIT(&root_dev.timer_hash[x]);
+	TAILQ_INIT(&root_dev.songs);
 
 	for (x = 0; x < UMIDI20_N_DEVICES; x++) {
+		pthread_mutex_init(&root_dev.rec[x].mtx, NULL);
+		pthread_mutex_init(&root_dev.play[x].mtx, NULL);
+
 		root_dev.rec[x].pipe = NULL;
 		root_dev.rec[x].device_no = x;
 		root_dev.rec[x].update = 1;
@@ -154,10 +265,14 @@ umidi20_init(void)
 	    &umidi20_watchdog_alloc, NULL)) {
 		root_dev.thread_alloc = PTHREAD_NULL;
 	}
-	if (pthread_create(&(root_dev.thread_play_rec), NULL,
-	    &umidi20_watchdog_play_rec, NULL)) {
+	if (umidi20_thread_create(&(root_dev.thread_play_rec),
+	    &umidi20_watchdog_play_rec, NULL, 1)) {
 		root_dev.thread_play_rec = PTHREAD_NULL;
 	}
+	if (pthread_create(&(root_dev.thread_timer), NULL,
+	    &umidi20_watchdog_timer, NULL)) {
+		root_dev.thread_timer = PTHREAD_NULL;
+	}
 	if (pthread_create(&(root_dev.thread_files), NULL,
 	    &umidi20_watchdog_files, NULL)) {
 		root_dev.thread_files = PTHREAD_NULL;
@@ -175,6 +290,9 @@ umidi20_uninit(void)
 	umidi20_stop_thread(&(root_dev.thread_play_rec),
 	    &root_dev.mutex);
 
+	umidi20_stop_thread(&(root_dev.thread_timer),
+	    &root_dev.mutex);
+
 	pthread_mutex_unlock(&root_dev.mutex);
 }
 
@@ -193,6 +311,9 @@ umidi20_stop_thread(pthread_t *p_td, pthread_mutex_t *p_mtx)
 		while (pthread_mutex_unlock(p_mtx) == 0)
 			recurse++;
 
+		umidi20_wakeup();
+		umidi20_wakeup_signal(&root_dev.timer_wakeup);
+
 #ifdef _WIN32
 		pthread_kill(td, SIGINT);
 #else
@@ -205,26 +326,212 @@ umidi20_stop_thread(pthread_t *p_td, pthread_mutex_t *p_mtx)
 	}
 }
 
+/*
+ * Set the realtime settings. Must be called before umidi20_init(),
+ * because only threads created afterwards use them. Memory locking is
+ * applied at once.
+ */
+void
+umidi20_set_rt_config(const struct umidi20_rt_config *cfg)
+{
+	pthread_mutex_lock(&umidi20_rt.mtx);
+	umidi20_rt.cfg = *cfg;
+
+#ifndef _WIN32
+	if (cfg->mlock != 0 && (umidi20_rt.status.applied & UMIDI20_RT_MLOCK) == 0) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+			umidi20_rt.status.applied |= UMIDI20_RT_MLOCK;
+			umidi20_rt.status.failed &= ~UMIDI20_RT_MLOCK;
+		} else {
+			umidi20_rt.status.failed |= UMIDI20_RT_MLOCK;
+		}
+	} else if (cfg->mlock == 0 && (umidi20_rt.status.applied & UMIDI20_RT_MLOCK) != 0) {
+		munlockall();
+		umidi20_rt.status.applied &= ~UMIDI20_RT_MLOCK;
+	}
+#else
+	if (cfg->mlock != 0)
+		umidi20_rt.status.failed |= UMIDI20_RT_MLOCK;
+#endif
+	pthread_mutex_unlock(&umidi20_rt.mtx);
+}
+
+/*
+ * Returns which realtime settings were applied and which failed,
+ * typically because of missing privileges.
+ */
+void
+umidi20_get_rt_status(struct umidi20_rt_status *status)
+{
+	pthread_mutex_lock(&umidi20_rt.mtx);
+	*status = umidi20_rt.status;
+	pthread_mutex_unlock(&umidi20_rt.mtx);
+}
+
+static void
+umidi20_rt_report(uint8_t flag, uint8_t applied)
+{
+	pthread_mutex_lock(&umidi20_rt.mtx);
+	if (applied)
+		umidi20_rt.status.applied |= flag;
+	else
+		umidi20_rt.status.failed |= flag;
+	pthread_mutex_unlock(&umidi20_rt.mtx);
+}
+
+/*
+ * Touch the given amount of stack, so that page faults don't happen
+ * later on, while events are being played. Each call touches one
+ * fixed size chunk, after recursing for the rest, so that the call
+ * cannot be turned into a loop reusing the same stack.
+ */
+static void __attribute__((__noinline__))
+umidi20_thread_prefault(uint32_t size)
+{
+	volatile uint8_t buffer[UMIDI20_RT_PREFAULT_CHUNK];
+	uint32_t x;
+
+	if (size > sizeof(buffer))
+		umidi20_thread_prefault(size - sizeof(buffer));
+
+	/* the stores must be volatile to not be optimized away */
+	for (x = 0; x < sizeof(buffer); x += 64)
+		buffer[x] = 0;
+}
+
+static void *
+umidi20_thread_start(void *arg)
+{
+	struct umidi20_thread_start ts = *(struct umidi20_thread_start *)arg;
+	uint8_t applied = 0;
+
+	free(arg);
+
+	if (ts.cpu > -1) {
+#if defined(__linux__)
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(ts.cpu, &set);
+		applied = (pthread_setaffinity_np(pthread_self(),
+		    sizeof(set), &set) == 0);
+#elif defined(__FreeBSD__)
+		cpuset_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(ts.cpu, &set);
+		applied = (pthread_setaffinity_np(pthread_self(),
+		    sizeof(set), &set) == 0);
+#endif
+		umidi20_rt_report(UMIDI20_RT_AFFINITY, applied);
+	}
+	if (ts.prefault != 0)
+		umidi20_thread_prefault(ts.prefault);
+
+	return ((ts.fn) (ts.arg));
+}
+
+/*
+ * Create a thread. If the "realtime" argument is set, the thread is
+ * created using the realtime settings given by
+ * umidi20_set_rt_config(). Settings which cannot be applied are
+ * skipped and reported by umidi20_get_rt_status().
+ */
+int
+umidi20_thread_create(pthread_t *ptd, void *(*fn)(void *), void *arg,
+    uint8_t realtime)
+{
+	struct umidi20_thread_start *pts;
+	struct umidi20_rt_config cfg;
+	struct sched_param param;
+	pthread_attr_t attr;
+	int error;
+
+	pthread_mutex_lock(&umidi20_rt.mtx);
+	cfg = umidi20_rt.cfg;
+	pthread_mutex_unlock(&umidi20_rt.mtx);
+
+	if (realtime == 0 || (cfg.priority == 0 &&
+	    cfg.cpu <= 0 && cfg.stack_size == 0))
+		return (pthread_create(ptd, NULL, fn, arg));
+
+	pts = malloc(sizeof(*pts));
+	if (pts == NULL)
+		return (ENOMEM);
+
+	pts->fn = fn;
+	pts->arg = arg;
+	pts->cpu = (cfg.cpu > 0) ? (cfg.cpu - 1) : -1;
+	pts->prefault = 0;
+
+	pthread_attr_init(&attr);
+
+	if (cfg.stack_size != 0) {
+		if (pthread_attr_setstacksize(&attr, cfg.stack_size) == 0) {
+			/* leave some stack for the thread itself */
+			pts->prefault = cfg.stack_size / 2;
+			if (pts->prefault > UMIDI20_RT_PREFAULT_MAX)
+				pts->prefault = UMIDI20_RT_PREFAULT_MAX;
+			umidi20_rt_report(UMIDI20_RT_STACK, 1);
+		} else {
+			umidi20_rt_report(UMIDI20_RT_STACK, 0);
+		}
+	}
+	if (cfg.priority != 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = cfg.priority;
+		if (param.sched_priority > sched_get_priority_max(SCHED_FIFO))
+			param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+		if (param.sched_priority < sched_get_priority_min(SCHED_FIFO))
+			param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+	error = pthread_create(ptd, &attr, &umidi20_thread_start, pts);
+	if (error != 0 && cfg.priority != 0) {
+		/* most likely not permitted, use the default scheduling */
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		error = pthread_create(ptd, &attr, &umidi20_thread_start, pts);
+		umidi20_rt_report(UMIDI20_RT_SCHED, 0);
+	} else if (error == 0 && cfg.priority != 0) {
+		umidi20_rt_report(UMIDI20_RT_SCHED, 1);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	if (error != 0) {
+		free(pts);
+		return (error);
+	}
+
+	pthread_mutex_lock(&umidi20_rt.mtx);
+	umidi20_rt.status.threads++;
+	pthread_mutex_unlock(&umidi20_rt.mtx);
+
+	return (0);
+}
+
 static void *
 umidi20_watchdog_alloc(void *arg)
 {
-	struct umidi20_event *event;
-
 	pthread_mutex_lock(&root_dev.mutex);
 
 	while (root_dev.thread_alloc != PTHREAD_NULL) {
+		pthread_mutex_unlock(&root_dev.mutex);
 
-		while (UMIDI20_IF_QLEN(&(root_dev.free_queue)) < UMIDI20_BUF_EVENTS) {
-			pthread_mutex_unlock(&root_dev.mutex);
-			event = umidi20_event_alloc(NULL, 0);
-			pthread_mutex_lock(&root_dev.mutex);
-			if (event) {
-				UMIDI20_IF_ENQUEUE_LAST(&(root_dev.free_queue), event);
-			} else {
+		/*
+		 * Keep a reserve of free events, so that the
+		 * realtime threads don't need to grow the pool:
+		 */
+		pthread_mutex_lock(&umidi20_event_pool.mtx);
+		while (umidi20_event_pool.stats.free < UMIDI20_BUF_EVENTS) {
+			if (umidi20_event_pool_grow())
 				break;
-			}
 		}
-		pthread_mutex_unlock(&root_dev.mutex);
+		pthread_mutex_unlock(&umidi20_event_pool.mtx);
 
 		usleep(100000);
 
@@ -236,11 +543,219 @@ umidi20_watchdog_alloc(void *arg)
 	return NULL;
 }
 
+/*
+ * The wakeups are counting semaphores, so that they can be signalled
+ * from realtime threads, like the JACK process callback writing the
+ * receive pipes, without taking any locks. The pending flag makes
+ * sure the semaphore is posted at most once per sleep.
+ */
+static void
+umidi20_wakeup_init(struct umidi20_wakeup *pw)
+{
+#ifdef __APPLE__
+	pw->sem = dispatch_semaphore_create(0);
+#else
+	sem_init(&pw->sem, 0, 0);
+#endif
+	pw->pending = 0;
+}
+
+static void
+umidi20_wakeup_destroy(struct umidi20_wakeup *pw)
+{
+#ifdef __APPLE__
+	dispatch_release(pw->sem);
+#else
+	sem_destroy(&pw->sem);
+#endif
+}
+
+static void
+umidi20_wakeup_signal(struct umidi20_wakeup *pw)
+{
+	if (__atomic_exchange_n(&pw->pending, 1, __ATOMIC_SEQ_CST) != 0)
+		return;
+#ifdef __APPLE__
+	dispatch_semaphore_signal(pw->sem);
+#else
+	sem_post(&pw->sem);
+#endif
+}
+
+/*
+ * Sleep until the given fine position is reached or until the
+ * wakeup is signalled. A position of UINT64_MAX means no timeout.
+ * The caller must not hold any other locks. A signal racing with
+ * the timeout may cause one spurious wakeup later on.
+ */
+static void
+umidi20_wakeup_sleep(struct umidi20_wakeup *pw, uint64_t position)
+{
+	struct timespec ts;
+#if defined(__APPLE__) || !(defined(__FreeBSD__) || defined(__GLIBC__))
+	struct timespec now;
+	int64_t nsec;
+#endif
+
+	ts = root_dev.start_time;
+	ts.tv_sec += position / (1000 << UMIDI20_POSITION_FINE_SHIFT);
+	ts.tv_nsec += ((position % (1000 << UMIDI20_POSITION_FINE_SHIFT)) *
+	    1000000) >> UMIDI20_POSITION_FINE_SHIFT;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_nsec -= 1000000000;
+		ts.tv_sec += 1;
+	}
+
+#ifdef __APPLE__
+	if (position == UINT64_MAX) {
+		dispatch_semaphore_wait(pw->sem, DISPATCH_TIME_FOREVER);
+	} else {
+		umidi20_gettime(&now);
+		nsec = (int64_t)(ts.tv_sec - now.tv_sec) * 1000000000LL +
+		    (ts.tv_nsec - now.tv_nsec);
+		if (nsec > 0) {
+			dispatch_semaphore_wait(pw->sem,
+			    dispatch_time(DISPATCH_TIME_NOW, nsec));
+		}
+	}
+#else
+	while (1) {
+		if (position == UINT64_MAX) {
+			if (sem_wait(&pw->sem) == 0 || errno != EINTR)
+				break;
+			continue;
+		}
+#if defined(__FreeBSD__)
+		if (sem_clockwait_np(&pw->sem, CLOCK_MONOTONIC,
+		    TIMER_ABSTIME, &ts, NULL) == 0 || errno != EINTR)
+			break;
+#elif defined(__GLIBC__)
+		if (sem_clockwait(&pw->sem, CLOCK_MONOTONIC, &ts) == 0 ||
+		    errno != EINTR)
+			break;
+#else
+		/* convert the deadline into the realtime clock */
+		umidi20_gettime(&now);
+		nsec = (int64_t)(ts.tv_sec - now.tv_sec) * 1000000000LL +
+		    (ts.tv_nsec - now.tv_nsec);
+		if (nsec <= 0)
+			break;
+		clock_gettime(CLOCK_REALTIME, &now);
+		nsec += now.tv_nsec;
+		now.tv_sec += nsec / 1000000000LL;
+		now.tv_nsec = nsec % 1000000000LL;
+		if (sem_timedwait(&pw->sem, &now) == 0 || errno != EINTR)
+			break;
+#endif
+	}
+#endif
+	__atomic_store_n(&pw->pending, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * This function wakes up the play and record thread, for example
+ * when new data is available for recording or when an event was
+ * queued which is due before the thread's current deadline.
+ */
+void
+umidi20_wakeup(void)
+{
+	umidi20_wakeup_signal(&root_dev.wakeup);
+}
+
+static void
+umidi20_watchdog_timeout_update(uint64_t *ptimeout, uint32_t delta,
+    uint8_t frac_a, uint8_t frac_b)
+{
+	uint64_t temp;
+
+	/* compute "delta.frac_a - 0.frac_b" */
+	temp = ((uint64_t)delta << UMIDI20_POSITION_FINE_SHIFT) + frac_a - frac_b;
+	if (temp < *ptimeout)
+		*ptimeout = temp;
+}
+
+/*
+ * Returns non-zero if the given event is due at the given fine
+ * position, relative to the device start position.
+ */
+static uint8_t
+umidi20_watchdog_event_due(struct umidi20_event *event,
+    uint32_t position, uint8_t frac)
+{
+	uint32_t delta = event->position - position;
+
+	return (delta >= 0x80000000 ||
+	    (delta == 0 && event->position_frac <= frac));
+}
+
+/*
+ * Compute the fine time until the next event, song or device
+ * timeout is due. Must be called having the root device locked.
+ */
+static uint64_t
+umidi20_watchdog_timeout(uint64_t position_fine)
+{
+	struct umidi20_device *dev;
+	struct umidi20_event *event;
+	struct umidi20_song *song;
+	uint64_t timeout = (uint64_t)UMIDI20_WAKEUP_MAX << UMIDI20_POSITION_FINE_SHIFT;
+	uint32_t position = position_fine >> UMIDI20_POSITION_FINE_SHIFT;
+	uint8_t frac = position_fine;
+	uint32_t rel;
+	uint32_t delta;
+	uint32_t x;
+
+	for (x = 0; x < UMIDI20_N_DEVICES; x++) {
+		dev = &root_dev.play[x];
+		rel = position - dev->start_position;
+
+		/* the queue is not played after a time overflow */
+		if (dev->enabled_usr && rel < dev->end_offset) {
+			umidi20_watchdog_timeout_update(&timeout, dev->end_offset - rel, 0, frac);
+
+			pthread_mutex_lock(&dev->mtx);
+			UMIDI20_IF_POLL_HEAD(&(dev->queue), event);
+			if (event != NULL) {
+				if (umidi20_watchdog_event_due(event, rel, frac)) {
+					pthread_mutex_unlock(&dev->mtx);
+					return (0);
+				}
+				delta = event->position - rel;
+				umidi20_watchdog_timeout_update(&timeout, delta,
+				    event->position_frac, frac);
+			}
+			pthread_mutex_unlock(&dev->mtx);
+		}
+
+		dev = &root_dev.rec[x];
+		rel = position - dev->start_position;
+
+		if (dev->enabled_usr && rel < dev->end_offset)
+			umidi20_watchdog_timeout_update(&timeout, dev->end_offset - rel, 0, frac);
+	}
+
+	TAILQ_FOREACH(song, &root_dev.songs, play_entry) {
+		if (song->play_next_valid == 0)
+			continue;
+		delta = song->play_next_pos - position;
+		if (delta >= 0x80000000 ||
+		    (delta == 0 && song->play_next_frac <= frac))
+			return (0);
+		umidi20_watchdog_timeout_update(&timeout, delta,
+		    song->play_next_frac, frac);
+	}
+	return (timeout);
+}
+
 static void *
 umidi20_watchdog_play_rec(void *arg)
 {
+	struct umidi20_event_queue copy;
+	struct umidi20_song *song;
 	struct timespec ts = {0, 0};
-	uint32_t position;
+	uint64_t position;
+	uint64_t timeout;
 	uint32_t x;
 
 	pthread_mutex_lock(&root_dev.mutex);
@@ -251,25 +766,37 @@ umidi20_watchdog_play_rec(void *arg)
 
 		root_dev.curr_time = ts;
 
-		position = umidi20_difftime
+		position = umidi20_difftime_fine
 		    (&(root_dev.curr_time), &(root_dev.start_time));
 
-		root_dev.curr_position = position;
+		__atomic_store_n(&root_dev.curr_position,
+		    (uint32_t)(position >> UMIDI20_POSITION_FINE_SHIFT),
+		    __ATOMIC_RELAXED);
 
 		for (x = 0; x < UMIDI20_N_DEVICES; x++) {
 			umidi20_watchdog_record_sub(&(root_dev.rec[x]), &(root_dev.play[x]),
 			    position);
 		}
 
-		umidi20_exec_timer(position);
-
 		for (x = 0; x < UMIDI20_N_DEVICES; x++) {
 			umidi20_watchdog_play_sub(&(root_dev.play[x]), position);
 		}
 
+		memset(&copy, 0, sizeof(copy));
+
+		TAILQ_FOREACH(song, &root_dev.songs, play_entry) {
+			umidi20_watchdog_play_song(song, &copy, position);
+		}
+
+		/* the song list may change during the play callbacks */
+		umidi20_watchdog_play_copy(&copy, position);
+
+		timeout = umidi20_watchdog_timeout(position);
+
 		pthread_mutex_unlock(&root_dev.mutex);
 
-		usleep(1000);
+		if (timeout != 0)
+			umidi20_wakeup_sleep(&root_dev.wakeup, position + timeout);
 
 		pthread_mutex_lock(&root_dev.mutex);
 	}
@@ -279,77 +806,234 @@ umidi20_watchdog_play_rec(void *arg)
 	return NULL;
 }
 
+/*
+ * The timers are kept in a binary heap ordered by their next timeout
+ * and in a hash table for lookup by callback and argument. Must be
+ * called having the timers locked.
+ */
+static uint8_t
+umidi20_timer_before(struct umidi20_timer_entry *a, struct umidi20_timer_entry *b)
+{
+	return ((int32_t)(a->timeout_pos - b->timeout_pos) < 0);
+}
+
 static void
-umidi20_exec_timer(uint32_t pos)
+umidi20_timer_heap_set(uint32_t x, struct umidi20_timer_entry *entry)
 {
-	struct umidi20_timer_entry *entry;
-	int32_t delta;
+	root_dev.timer_heap[x] = entry;
+	entry->heap_index = x;
+}
 
-restart:
+static void
+umidi20_timer_heap_fix(uint32_t x)
+{
+	struct umidi20_timer_entry **heap = root_dev.timer_heap;
+	struct umidi20_timer_entry *entry = heap[x];
+	uint32_t y;
 
-	TAILQ_FOREACH(entry, &root_dev.timers, entry) {
-		delta = entry->timeout_pos - pos;
-		if ((delta < 0) || ((uint32_t)delta > entry->ms_interval)) {
+	while (x != 0) {
+		y = (x - 1) / 2;
+		if (!umidi20_timer_before(entry, heap[y]))
+			break;
+		umidi20_timer_heap_set(x, heap[y]);
+		x = y;
+	}
+	while (1) {
+		y = (2 * x) + 1;
+		if (y >= root_dev.timer_num)
+			break;
+		if (y + 1 < root_dev.timer_num &&
+		    umidi20_timer_before(heap[y + 1], heap[y]))
+			y++;
+		if (!umidi20_timer_before(heap[y], entry))
+			break;
+		umidi20_timer_heap_set(x, heap[y]);
+		x = y;
+	}
+	umidi20_timer_heap_set(x, entry);
+}
 
-			/* check if next timeout is valid, else reset */
+static void
+umidi20_timer_heap_remove(struct umidi20_timer_entry *entry)
+{
+	uint32_t x = entry->heap_index;
 
-			if (delta < -1000 || (uint32_t)delta > entry->ms_interval) {
-				/* reset */
-				entry->timeout_pos = pos;
-			} else if (delta < 0) {
-				/* try to stay sync */
-				while (delta < 0) {
-					/* try to stay sync */
-					entry->timeout_pos += entry->ms_interval;
-					delta += entry->ms_interval;
-				}
-				entry->timeout_pos -= entry->ms_interval;
-			}
-			entry->pending = 1;
-			pthread_mutex_unlock(&root_dev.mutex);
-			(entry->fn) (entry->arg);
-			pthread_mutex_lock(&root_dev.mutex);
-			entry->pending = 0;
-			pthread_cond_broadcast(&root_dev.cond);
-			/* allow callback to update the interval */
-			entry->timeout_pos += entry->ms_interval;
-			goto restart;
-		}
+	root_dev.timer_num--;
+	if (x != root_dev.timer_num) {
+		umidi20_timer_heap_set(x, root_dev.timer_heap[root_dev.timer_num]);
+		umidi20_timer_heap_fix(x);
 	}
 }
 
-void
-umidi20_update_timer(umidi20_timer_callback_t *fn, void *arg, uint32_t ms_interval, uint8_t do_sync)
+static uint32_t
+umidi20_timer_hash(umidi20_timer_callback_t *fn, void *arg)
 {
-	struct umidi20_timer_entry *entry;
+	uintptr_t hash;
 
-	/* check for invalid interval */
-	if (ms_interval == 0)
-		return;
-	/* check for too big interval */
-	if (ms_interval > 65535)
-		ms_interval = 65535;
+	hash = (uintptr_t)fn ^ (uintptr_t)arg;
+	hash ^= (hash >> 6) ^ (hash >> 12);
 
-	pthread_mutex_lock(&root_dev.mutex);
+	return (hash % UMIDI20_TIMER_HASH);
+}
 
-	TAILQ_FOREACH(entry, &root_dev.timers, entry) {
-		if ((entry->fn == fn) && (entry->arg == arg)) {
+static struct umidi20_timer_entry *
+umidi20_timer_lookup(umidi20_timer_callback_t *fn, void *arg)
+{
+	struct umidi20_timer_entry *entry;
+
+	LIST_FOREACH(entry, &root_dev.timer_hash[umidi20_timer_hash(fn, arg)], entry) {
+		if ((entry->fn == fn) && (entry->arg == arg))
 			break;
-		}
 	}
-	if (entry != NULL) {
-		entry->ms_interval = ms_interval;
-		if (do_sync)
-			entry->timeout_pos = root_dev.curr_position;
-	}
-	pthread_mutex_unlock(&root_dev.mutex);
+	return (entry);
 }
 
-void
-umidi20_set_timer(umidi20_timer_callback_t *fn, void *arg, uint32_t ms_interval)
+/*
+ * Execute the timers which are due and return the fine position of
+ * the next timeout, or UINT64_MAX if there are no timers.
+ */
+static uint64_t
+umidi20_exec_timer(uint64_t position_fine)
+{
+	struct umidi20_timer_entry *entry;
+	uint64_t busy;
+	uint32_t late;
+	uint32_t pos = position_fine >> UMIDI20_POSITION_FINE_SHIFT;
+	int32_t delta;
+
+	pthread_mutex_lock(&root_dev.timer_mtx);
+
+	while (root_dev.timer_num != 0) {
+		entry = root_dev.timer_heap[0];
+		delta = entry->timeout_pos - pos;
+		if ((delta >= 0) && ((uint32_t)delta <= entry->ms_interval))
+			break;
+
+		/* the timeout is late, if more than one ms passed */
+		if (delta < 0) {
+			late = -(delta + 1);
+			if (late > entry->stats.late_max)
+				entry->stats.late_max = late;
+			entry->stats.overruns += late / entry->ms_interval;
+		}
+
+		/* check if next timeout is valid, else reset */
+
+		if (delta < -1000 || (uint32_t)delta > entry->ms_interval) {
+			/* reset */
+			entry->timeout_pos = pos;
+		} else if (delta < 0) {
+			/* try to stay sync */
+			while (delta < 0) {
+				/* try to stay sync */
+				entry->timeout_pos += entry->ms_interval;
+				delta += entry->ms_interval;
+			}
+			entry->timeout_pos -= entry->ms_interval;
+		}
+		entry->pending = 1;
+		pthread_mutex_unlock(&root_dev.timer_mtx);
+		busy = umidi20_get_curr_position_fine();
+		(entry->fn) (entry->arg);
+		busy = umidi20_get_curr_position_fine() - busy;
+		pthread_mutex_lock(&root_dev.timer_mtx);
+		entry->pending = 0;
+		pthread_cond_broadcast(&root_dev.timer_cond);
+
+		/* check if the timer was unset by the callback */
+		if (entry->fn == NULL)
+			continue;
+
+		busy = (busy * 1000) >> UMIDI20_POSITION_FINE_SHIFT;
+		if (busy > entry->stats.busy_max)
+			entry->stats.busy_max = (busy > UINT32_MAX) ? UINT32_MAX : busy;
+		entry->stats.calls++;
+
+		/* allow callback to update the interval */
+		entry->timeout_pos += entry->ms_interval;
+		umidi20_timer_heap_fix(entry->heap_index);
+	}
+
+	if (root_dev.timer_num != 0) {
+		/* timers are executed when the position is passed */
+		delta = root_dev.timer_heap[0]->timeout_pos - pos + 1;
+		position_fine = ((position_fine >> UMIDI20_POSITION_FINE_SHIFT) +
+		    delta) << UMIDI20_POSITION_FINE_SHIFT;
+	} else {
+		position_fine = UINT64_MAX;
+	}
+
+	pthread_mutex_unlock(&root_dev.timer_mtx);
+
+	return (position_fine);
+}
+
+/*
+ * The timer callbacks are executed by a separate thread, so that slow
+ * callbacks don't delay the playback and recording of events.
+ */
+static void *
+umidi20_watchdog_timer(void *arg)
+{
+	uint64_t position;
+
+	pthread_mutex_lock(&root_dev.mutex);
+
+	while (root_dev.thread_timer != PTHREAD_NULL) {
+		pthread_mutex_unlock(&root_dev.mutex);
+
+		position = umidi20_exec_timer(umidi20_get_curr_position_fine());
+
+		umidi20_wakeup_sleep(&root_dev.timer_wakeup, position);
+
+		pthread_mutex_lock(&root_dev.mutex);
+	}
+
+	pthread_mutex_unlock(&root_dev.mutex);
+
+	return NULL;
+}
+
+void
+umidi20_update_timer(umidi20_timer_callback_t *fn, void *arg, uint32_t ms_interval, uint8_t do_sync)
+{
+	struct umidi20_timer_entry *entry;
+	uint32_t pos;
+
+	/* check for invalid interval */
+	if (ms_interval == 0)
+		return;
+	/* check for too big interval */
+	if (ms_interval > 65535)
+		ms_interval = 65535;
+
+	pthread_mutex_lock(&root_dev.timer_mtx);
+
+	entry = umidi20_timer_lookup(fn, arg);
+	if (entry != NULL) {
+		entry->ms_interval = ms_interval;
+		if (do_sync) {
+			entry->timeout_pos = umidi20_get_curr_position();
+		} else {
+			/* don't wait for a timeout of a longer interval */
+			pos = umidi20_get_curr_position() + ms_interval;
+			if ((int32_t)(entry->timeout_pos - pos) > 0)
+				entry->timeout_pos = pos;
+		}
+		umidi20_timer_heap_fix(entry->heap_index);
+	}
+	pthread_mutex_unlock(&root_dev.timer_mtx);
+
+	umidi20_wakeup_signal(&root_dev.timer_wakeup);
+}
+
+void
+umidi20_set_timer(umidi20_timer_callback_t *fn, void *arg, uint32_t ms_interval)
 {
 	struct umidi20_timer_entry *entry;
 	struct umidi20_timer_entry *new_entry;
+	struct umidi20_timer_entry **heap;
+	uint32_t max;
 
 	if (ms_interval == 0) {
 		umidi20_unset_timer(fn, arg);
@@ -362,32 +1046,48 @@ umidi20_set_timer(umidi20_timer_callback_t *fn, void *arg, uint32_t ms_interval)
 	if (new_entry == NULL)
 		return;
 
-	pthread_mutex_lock(&root_dev.mutex);
-
-	TAILQ_FOREACH(entry, &root_dev.timers, entry) {
-		if ((entry->fn == fn) && (entry->arg == arg)) {
-			break;
-		}
-	}
+	pthread_mutex_lock(&root_dev.timer_mtx);
 
+	entry = umidi20_timer_lookup(fn, arg);
 	if (entry != NULL) {
 		/* first timeout ASAP */
 		entry->ms_interval = ms_interval;
-		entry->timeout_pos = root_dev.curr_position;
+		entry->timeout_pos = umidi20_get_curr_position();
+		umidi20_timer_heap_fix(entry->heap_index);
 
-		pthread_mutex_unlock(&root_dev.mutex);
+		pthread_mutex_unlock(&root_dev.timer_mtx);
 		free(new_entry);
+		umidi20_wakeup_signal(&root_dev.timer_wakeup);
 		return;
 	}
+	if (root_dev.timer_num == root_dev.timer_max) {
+		max = root_dev.timer_max ? (2 * root_dev.timer_max) : 16;
+		heap = realloc(root_dev.timer_heap, sizeof(heap[0]) * max);
+		if (heap == NULL) {
+			pthread_mutex_unlock(&root_dev.timer_mtx);
+			free(new_entry);
+			return;
+		}
+		root_dev.timer_heap = heap;
+		root_dev.timer_max = max;
+	}
 	new_entry->fn = fn;
 	new_entry->arg = arg;
 	new_entry->ms_interval = ms_interval;
-	new_entry->timeout_pos = root_dev.curr_position + ms_interval;
+	new_entry->timeout_pos = umidi20_get_curr_position() + ms_interval;
 	new_entry->pending = 0;
+	memset(&new_entry->stats, 0, sizeof(new_entry->stats));
 
-	TAILQ_INSERT_TAIL(&root_dev.timers, new_entry, entry);
+	LIST_INSERT_HEAD(&root_dev.timer_hash[umidi20_timer_hash(fn, arg)],
+	    new_entry, entry);
 
-	pthread_mutex_unlock(&root_dev.mutex);
+	umidi20_timer_heap_set(root_dev.timer_num, new_entry);
+	root_dev.timer_num++;
+	umidi20_timer_heap_fix(new_entry->heap_index);
+
+	pthread_mutex_unlock(&root_dev.timer_mtx);
+
+	umidi20_wakeup_signal(&root_dev.timer_wakeup);
 }
 
 void
@@ -395,38 +1095,60 @@ umidi20_unset_timer(umidi20_timer_callback_t *fn, void *arg)
 {
 	struct umidi20_timer_entry *entry;
 
-	pthread_mutex_lock(&root_dev.mutex);
-	TAILQ_FOREACH(entry, &root_dev.timers, entry) {
-		if ((entry->fn == fn) && (entry->arg == arg)) {
-			TAILQ_REMOVE(&root_dev.timers, entry, entry);
-			while (entry->pending != 0)
-				pthread_cond_wait(&root_dev.cond, &root_dev.mutex);
-			pthread_mutex_unlock(&root_dev.mutex);
-			free(entry);
-			return;
-		}
+	pthread_mutex_lock(&root_dev.timer_mtx);
+	entry = umidi20_timer_lookup(fn, arg);
+	if (entry != NULL) {
+		LIST_REMOVE(entry, entry);
+		umidi20_timer_heap_remove(entry);
+		/* tell umidi20_exec_timer() the entry is gone */
+		entry->fn = NULL;
+		while (entry->pending != 0)
+			pthread_cond_wait(&root_dev.timer_cond, &root_dev.timer_mtx);
+		pthread_mutex_unlock(&root_dev.timer_mtx);
+		free(entry);
+		return;
 	}
-	pthread_mutex_unlock(&root_dev.mutex);
+	pthread_mutex_unlock(&root_dev.timer_mtx);
+}
+
+int
+umidi20_get_timer_stats(umidi20_timer_callback_t *fn, void *arg,
+    struct umidi20_timer_stats *stats)
+{
+	struct umidi20_timer_entry *entry;
+
+	pthread_mutex_lock(&root_dev.timer_mtx);
+	entry = umidi20_timer_lookup(fn, arg);
+	if (entry != NULL)
+		*stats = entry->stats;
+	pthread_mutex_unlock(&root_dev.timer_mtx);
+
+	return ((entry != NULL) ? 0 : -1);
 }
 
 static void
 umidi20_watchdog_record_sub(struct umidi20_device *dev,
     struct umidi20_device *play_dev,
-    uint32_t curr_position)
+    uint64_t position_fine)
 {
 	struct umidi20_event *event;
+	uint32_t curr_position;
 	ssize_t len;
+	uint64_t ts[16];
 	uint8_t cmd[16];
 	uint8_t drop;
 	uint8_t x;
 
-	curr_position -= dev->start_position;
+	curr_position = (position_fine >> UMIDI20_POSITION_FINE_SHIFT) -
+	    dev->start_position;
 
 	if (curr_position >= dev->end_offset) {
 		/* time overflow */
 		if (dev->enabled_usr) {
 			DPRINTF("time overflow\n");
+			pthread_mutex_lock(&dev->mtx);
 			dev->enabled_usr = 0;
+			pthread_mutex_unlock(&dev->mtx);
 		}
 	}
 	/* record */
@@ -435,185 +1157,456 @@ umidi20_watchdog_record_sub(struct umidi20_device *dev,
 		return;
 
 	/*
-	 * Read data regularly so that the buffer-size is kept
-	 * low, even if not recording. A length of zero
-	 * usually means end of file.
+	 * Read all available data, so that the buffer-size is kept
+	 * low, even if not recording. A length of zero usually means
+	 * end of file.
 	 */
-	if ((len = umidi20_pipe_read_data(dev->pipe, cmd, sizeof(cmd))) <= 0) {
-		if (len < 0)
-			dev->update = 1;
-		return;
-	}
-	if (dev->enabled_usr == 0)
-		return;
+	while ((len = umidi20_pipe_read_data_ts(dev->pipe, cmd, ts, sizeof(cmd))) > 0) {
 
-	for (x = 0; x != (uint8_t)len; x++) {
+		if (dev->enabled_usr == 0)
+			continue;
 
-		event = umidi20_convert_to_event(&(dev->conv), cmd[x], 1);
+		for (x = 0; x != (uint8_t)len; x++) {
 
-		if (event == NULL)
-			continue;
+			event = umidi20_convert_to_event(&(dev->conv), cmd[x], 1);
 
-		DPRINTF("pos = %d\n", curr_position);
+			if (event == NULL)
+				continue;
 
-		event->device_no = dev->device_no;
-		event->position = curr_position;
+			/* use the time the last byte was received */
+			event->device_no = dev->device_no;
+			event->position = (ts[x] >> UMIDI20_POSITION_FINE_SHIFT) -
+			    dev->start_position;
+			event->position_frac = ts[x];
 
-		drop = 0;
+			/* received before the device was started */
+			if (event->position >= 0x80000000) {
+				event->position = 0;
+				event->position_frac = 0;
+			}
 
-		if (dev->event_callback_func != NULL) {
+			DPRINTF("pos = %d\n", event->position);
 
-			pthread_mutex_unlock(&root_dev.mutex);
+			drop = 0;
 
-			(dev->event_callback_func) (dev->device_no,
-			    dev->event_callback_arg, event, &drop);
+			if (dev->event_callback_func != NULL) {
 
-			pthread_mutex_lock(&root_dev.mutex);
-		}
-		if (drop) {
-			umidi20_event_free(event);
-		} else {
-			umidi20_event_queue_insert
-			    (&(dev->queue), event, UMIDI20_CACHE_INPUT);
+				pthread_mutex_unlock(&root_dev.mutex);
+
+				(dev->event_callback_func) (dev->device_no,
+				    dev->event_callback_arg, event, &drop);
+
+				pthread_mutex_lock(&root_dev.mutex);
+			}
+			if (drop) {
+				umidi20_event_free(event);
+			} else {
+				pthread_mutex_lock(&dev->mtx);
+				umidi20_event_queue_insert
+				    (&(dev->queue), event, UMIDI20_CACHE_INPUT);
+				pthread_mutex_unlock(&dev->mtx);
+			}
 		}
+		if (dev->pipe == NULL)
+			return;
 	}
+	if (len < 0)
+		dev->update = 1;
 }
 
-static void
-umidi20_watchdog_play_sub(struct umidi20_device *dev,
-    uint32_t curr_position)
+static uint32_t
+umidi20_histogram_bucket(uint64_t value)
 {
-	struct umidi20_event *event;
-	struct umidi20_event *event_root;
-	uint32_t delta_position;
-	ssize_t err;
-	uint8_t len;
-	uint8_t drop;
+	uint32_t msb;
+	uint32_t x;
 
-	/* playback */
+	if (value < 4)
+		return (value);
 
-	curr_position -= dev->start_position;
+	msb = 63 - __builtin_clzll(value);
+	x = ((msb - 1) << 2) | ((value >> (msb - 2)) & 3);
 
-	if (curr_position >= dev->end_offset) {
-		/* time overflow */
-		if (dev->enabled_usr) {
-			DPRINTF("time overflow\n");
-			dev->enabled_usr = 0;
-		}
-		return;
+	return ((x < UMIDI20_HIST_BUCKETS) ? x : (UMIDI20_HIST_BUCKETS - 1));
+}
+
+/* returns the largest value counted in the given bucket */
+static uint64_t
+umidi20_histogram_value(uint32_t x)
+{
+	if (x < 4)
+		return (x);
+	if (x == UMIDI20_HIST_BUCKETS - 1)
+		return (UINT64_MAX);
+	x++;
+	return (((uint64_t)(4 | (x & 3)) << ((x >> 2) - 1)) - 1);
+}
+
+static void
+umidi20_histogram_add(struct umidi20_histogram *hist, uint64_t value)
+{
+	uint64_t max;
+
+	__atomic_fetch_add(&hist->count[umidi20_histogram_bucket(value)], 1,
+	    __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->total, value, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while (value > max) {
+		if (__atomic_compare_exchange_n(&hist->max, &max, value, 0,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
 	}
-	while (1) {
+}
 
-		UMIDI20_IF_POLL_HEAD(&(dev->queue), event_root);
-		event = event_root;
+static void
+umidi20_histogram_copy(struct umidi20_histogram *dst,
+    struct umidi20_histogram *src, uint8_t reset)
+{
+	uint32_t x;
 
-		if (event == NULL) {
+	for (x = 0; x != UMIDI20_HIST_BUCKETS; x++)
+		dst->count[x] = reset ?
+		    __atomic_exchange_n(&src->count[x], 0, __ATOMIC_RELAXED) :
+		    __atomic_load_n(&src->count[x], __ATOMIC_RELAXED);
+	dst->total = reset ?
+	    __atomic_exchange_n(&src->total, 0, __ATOMIC_RELAXED) :
+	    __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+	dst->max = reset ?
+	    __atomic_exchange_n(&src->max, 0, __ATOMIC_RELAXED) :
+	    __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns an upper bound for the given percentile, in 1/1000, of the
+ * values counted by the histogram. Zero is returned if the histogram
+ * is empty.
+ */
+uint64_t
+umidi20_histogram_percentile(const struct umidi20_histogram *hist,
+    uint32_t permille)
+{
+	uint64_t sum = 0;
+	uint64_t limit;
+	uint32_t x;
+
+	for (x = 0; x != UMIDI20_HIST_BUCKETS; x++)
+		sum += hist->count[x];
+	if (sum == 0)
+		return (0);
+
+	if (permille > 1000)
+		permille = 1000;
+	limit = (sum * permille + 999) / 1000;
+	if (limit == 0)
+		limit = 1;
+
+	sum = 0;
+	for (x = 0; x != UMIDI20_HIST_BUCKETS; x++) {
+		sum += hist->count[x];
+		if (sum >= limit)
 			break;
-		}
-		delta_position = (event->position - curr_position);
+	}
+	if (umidi20_histogram_value(x) > hist->max)
+		return (hist->max);
+	return (umidi20_histogram_value(x));
+}
 
-		if (delta_position >= 0x80000000) {
+/*
+ * Get a snapshot of the statistics of the given play device. The
+ * statistics are updated without locking, so the snapshot may be
+ * slightly inconsistent.
+ */
+void
+umidi20_get_device_stats(uint8_t device_no, struct umidi20_device_stats *stats)
+{
+	struct umidi20_device_stats *ps;
 
-			drop = 0;
+	memset(stats, 0, sizeof(*stats));
 
-			if (dev->event_callback_func != NULL) {
+	if (device_no >= UMIDI20_N_DEVICES)
+		return;
 
-				pthread_mutex_unlock(&root_dev.mutex);
+	ps = &root_dev.play[device_no].stats;
 
-				(dev->event_callback_func) (dev->device_no,
-				    dev->event_callback_arg, event, &drop);
+	umidi20_histogram_copy(&stats->late, &ps->late, 0);
+	umidi20_histogram_copy(&stats->callback, &ps->callback, 0);
+	umidi20_histogram_copy(&stats->depth, &ps->depth, 0);
+	stats->drops = __atomic_load_n(&ps->drops, __ATOMIC_RELAXED);
+}
 
-				pthread_mutex_lock(&root_dev.mutex);
-			}
-			if ((dev->pipe != NULL) &&
-			    (dev->enabled_usr) &&
-			    (event->cmd[1] != 0xFF) &&
-			    (!drop)) {
+void
+umidi20_reset_device_stats(uint8_t device_no)
+{
+	struct umidi20_device_stats *ps;
+	struct umidi20_device_stats temp;
 
-				/* only write non-meta/reset commands */
+	if (device_no >= UMIDI20_N_DEVICES)
+		return;
 
-				do {
-					len = umidi20_command_to_len[event->cmd[0] & 0xF];
+	ps = &root_dev.play[device_no].stats;
 
-					if (umidi20_event_is_key_start(event))
-						dev->any_key_start = 1;
+	umidi20_histogram_copy(&temp.late, &ps->late, 1);
+	umidi20_histogram_copy(&temp.callback, &ps->callback, 1);
+	umidi20_histogram_copy(&temp.depth, &ps->depth, 1);
+	__atomic_store_n(&ps->drops, 0, __ATOMIC_RELAXED);
+}
 
-					/* try to write data */
+static int umidi20_stats_dump_fd = -1;
 
-					err = umidi20_pipe_write_data(dev->pipe, event->cmd + 1, len);
-					if (err < 0) {
-						/* try to re-open the device */
-						dev->update = 1;
-						break;
-					} else if (err != len) {
-						/*
-						 * we are done - the queue
-						 * is full
-						 */
-						break;
-					}
-				} while ((event = event->p_next));
-			}
-			UMIDI20_IF_REMOVE(&(dev->queue), event_root);
+static void
+umidi20_stats_dump(void *arg)
+{
+	struct umidi20_device_stats stats;
+	char buffer[256];
+	uint64_t events;
+	uint32_t x;
+	uint32_t y;
+	int fd;
+	int len;
 
-			umidi20_event_free(event_root);
-		} else {
+	fd = __atomic_load_n(&umidi20_stats_dump_fd, __ATOMIC_RELAXED);
+	if (fd < 0)
+		return;
+
+	for (x = 0; x != UMIDI20_N_DEVICES; x++) {
+		umidi20_get_device_stats(x, &stats);
+
+		events = 0;
+		for (y = 0; y != UMIDI20_HIST_BUCKETS; y++)
+			events += stats.late.count[y];
+		if (events == 0 && stats.drops == 0)
+			continue;
+
+		len = snprintf(buffer, sizeof(buffer),
+		    "umidi20: play=%u events=%llu "
+		    "late_p50=%llu late_p99=%llu late_max=%llu "
+		    "callback_p99=%llu callback_max=%llu "
+		    "depth_p99=%llu depth_max=%llu drops=%llu\n", x,
+		    (unsigned long long)events,
+		    (unsigned long long)umidi20_histogram_percentile(&stats.late, 500),
+		    (unsigned long long)umidi20_histogram_percentile(&stats.late, 990),
+		    (unsigned long long)stats.late.max,
+		    (unsigned long long)umidi20_histogram_percentile(&stats.callback, 990),
+		    (unsigned long long)stats.callback.max,
+		    (unsigned long long)umidi20_histogram_percentile(&stats.depth, 990),
+		    (unsigned long long)stats.depth.max,
+		    (unsigned long long)stats.drops);
+
+		if (len > 0 && write(fd, buffer, MIN(len, (int)sizeof(buffer) - 1)) < 0)
 			break;
-		}
 	}
 }
 
-static void *
-umidi20_watchdog_files(void *arg)
+/*
+ * Periodically write the play device statistics, one line per active
+ * device, to the given file descriptor. An interval of zero or a
+ * negative file descriptor stops the dump.
+ */
+void
+umidi20_set_stats_dump(int fd, uint32_t ms_interval)
 {
-	struct umidi20_device *dev;
-	struct umidi20_pipe **pipe;
-	uint32_t x;
+	if (fd < 0 || ms_interval == 0) {
+		umidi20_unset_timer(&umidi20_stats_dump, NULL);
+		__atomic_store_n(&umidi20_stats_dump_fd, -1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(&umidi20_stats_dump_fd, fd, __ATOMIC_RELAXED);
+		umidi20_set_timer(&umidi20_stats_dump, NULL, ms_interval);
+	}
+}
 
-	pthread_mutex_lock(&root_dev.mutex);
+/*
+ * Pass the given due event to the play callback and write it to the
+ * device. The event is not freed. Must be called having the root
+ * device locked.
+ */
+static void
+umidi20_device_output(struct umidi20_device *dev,
+    struct umidi20_event *event, uint64_t position_fine,
+    uint32_t curr_position, uint8_t curr_frac)
+{
+	uint64_t ts;
+	uint64_t now;
+	ssize_t err;
+	uint8_t len;
+	uint8_t drop;
 
-	while (root_dev.thread_files != PTHREAD_NULL) {
+	drop = 0;
 
-		for (x = 0; x < UMIDI20_N_DEVICES; x++) {
+	if (dev->event_callback_func != NULL) {
 
-			dev = &root_dev.play[x];
+		pthread_mutex_unlock(&root_dev.mutex);
 
-			if (dev->update) {
+		now = umidi20_get_curr_position_fine();
 
-				pipe = dev->pipe;
-				dev->pipe = NULL;
+		(dev->event_callback_func) (dev->device_no,
+		    dev->event_callback_arg, event, &drop);
 
-				if (pipe != NULL) {
-					switch (dev->enabled_cfg_last) {
-					case UMIDI20_ENABLED_CFG_DEV:
-						umidi20_cdev_tx_close(x);
-						break;
-					case UMIDI20_ENABLED_CFG_JACK:
-						umidi20_jack_tx_close(x);
-						break;
-					case UMIDI20_ENABLED_CFG_COREMIDI:
-						umidi20_coremidi_tx_close(x);
-						break;
-					case UMIDI20_ENABLED_CFG_ANDROID:
-						umidi20_android_tx_close(x);
-						break;
-					case UMIDI20_ENABLED_CFG_ALSA:
-						umidi20_alsa_tx_close(x);
-						break;
-					default:
-						break;
-					}
-				}
-				switch (dev->enabled_cfg) {
-				case UMIDI20_ENABLED_CFG_DEV:
-					pipe = umidi20_cdev_tx_open(x, dev->fname);
-					break;
-				case UMIDI20_ENABLED_CFG_JACK:
-					pipe = umidi20_jack_tx_open(x, dev->fname);
-					break;
-				case UMIDI20_ENABLED_CFG_COREMIDI:
-					pipe = umidi20_coremidi_tx_open(x, dev->fname);
-					break;
+		now = umidi20_get_curr_position_fine() - now;
+		umidi20_histogram_add(&dev->stats.callback,
+		    (now * 1000) >> UMIDI20_POSITION_FINE_SHIFT);
+
+		pthread_mutex_lock(&root_dev.mutex);
+	}
+	if ((dev->pipe != NULL) &&
+	    (dev->enabled_usr) &&
+	    (event->cmd[1] != 0xFF) &&
+	    (!drop)) {
+
+		/* only write non-meta/reset commands */
+
+		/* pass on the scheduled time */
+		ts = position_fine -
+		    ((uint64_t)(curr_position - event->position) <<
+		    UMIDI20_POSITION_FINE_SHIFT) -
+		    curr_frac + event->position_frac;
+
+		/* record how late the event is written */
+		now = umidi20_get_curr_position_fine();
+		umidi20_histogram_add(&dev->stats.late, (now > ts) ?
+		    (((now - ts) * 1000) >> UMIDI20_POSITION_FINE_SHIFT) : 0);
+
+		do {
+			len = umidi20_command_to_len[event->cmd[0] & 0xF];
+
+			if (umidi20_event_is_key_start(event))
+				dev->any_key_start = 1;
+
+			/* try to write data */
+
+			err = umidi20_pipe_write_data_ts(dev->pipe,
+			    event->cmd + 1, len, ts);
+			if (err < 0) {
+				/* try to re-open the device */
+				dev->update = 1;
+				break;
+			} else if (err != len) {
+				/*
+				 * we are done - the queue
+				 * is full, count the event
+				 * as dropped once
+				 */
+				__atomic_fetch_add(&dev->stats.drops,
+				    1, __ATOMIC_RELAXED);
+				break;
+			}
+		} while ((event = event->p_next));
+	}
+}
+
+static void
+umidi20_watchdog_play_sub(struct umidi20_device *dev,
+    uint64_t position_fine)
+{
+	struct umidi20_event_queue due;
+	struct umidi20_event *event;
+	uint32_t curr_position;
+	uint8_t curr_frac;
+
+	/* playback */
+
+	curr_position = (position_fine >> UMIDI20_POSITION_FINE_SHIFT) -
+	    dev->start_position;
+	curr_frac = position_fine;
+
+	pthread_mutex_lock(&dev->mtx);
+
+	if (curr_position >= dev->end_offset) {
+		/* time overflow */
+		if (dev->enabled_usr) {
+			DPRINTF("time overflow\n");
+			dev->enabled_usr = 0;
+		}
+		pthread_mutex_unlock(&dev->mtx);
+		return;
+	}
+
+	/* only keep the device locked while taking the due events */
+	memset(&due, 0, sizeof(due));
+
+	while (1) {
+
+		UMIDI20_IF_POLL_HEAD(&(dev->queue), event);
+
+		if (event == NULL ||
+		    !umidi20_watchdog_event_due(event, curr_position, curr_frac))
+			break;
+
+		UMIDI20_IF_REMOVE(&(dev->queue), event);
+		UMIDI20_IF_ENQUEUE_LAST(&due, event);
+	}
+
+	if (due.ifq_len != 0) {
+		umidi20_histogram_add(&dev->stats.depth,
+		    due.ifq_len + dev->queue.ifq_len);
+	}
+
+	pthread_mutex_unlock(&dev->mtx);
+
+	while (1) {
+
+		UMIDI20_IF_DEQUEUE(&due, event);
+
+		if (event == NULL)
+			break;
+
+		umidi20_device_output(dev, event, position_fine,
+		    curr_position, curr_frac);
+
+		umidi20_event_free(event);
+	}
+}
+
+static void *
+umidi20_watchdog_files(void *arg)
+{
+	struct umidi20_device *dev;
+	struct umidi20_pipe **pipe;
+	uint32_t x;
+
+	pthread_mutex_lock(&root_dev.mutex);
+
+	while (root_dev.thread_files != PTHREAD_NULL) {
+
+		for (x = 0; x < UMIDI20_N_DEVICES; x++) {
+
+			dev = &root_dev.play[x];
+
+			if (dev->update) {
+
+				pipe = dev->pipe;
+				dev->pipe = NULL;
+
+				if (pipe != NULL) {
+					switch (dev->enabled_cfg_last) {
+					case UMIDI20_ENABLED_CFG_DEV:
+						umidi20_cdev_tx_close(x);
+						break;
+					case UMIDI20_ENABLED_CFG_JACK:
+						umidi20_jack_tx_close(x);
+						break;
+					case UMIDI20_ENABLED_CFG_COREMIDI:
+						umidi20_coremidi_tx_close(x);
+						break;
+					case UMIDI20_ENABLED_CFG_ANDROID:
+						umidi20_android_tx_close(x);
+						break;
+					case UMIDI20_ENABLED_CFG_ALSA:
+						umidi20_alsa_tx_close(x);
+						break;
+					default:
+						break;
+					}
+				}
+				switch (dev->enabled_cfg) {
+				case UMIDI20_ENABLED_CFG_DEV:
+					pipe = umidi20_cdev_tx_open(x, dev->fname);
+					break;
+				case UMIDI20_ENABLED_CFG_JACK:
+					pipe = umidi20_jack_tx_open(x, dev->fname);
+					break;
+				case UMIDI20_ENABLED_CFG_COREMIDI:
+					pipe = umidi20_coremidi_tx_open(x, dev->fname);
+					break;
 				case UMIDI20_ENABLED_CFG_ANDROID:
 					pipe = umidi20_android_tx_open(x, dev->fname);
 					break;
@@ -698,43 +1691,225 @@ umidi20_watchdog_files(void *arg)
 	return NULL;
 }
 
+/*
+ * Must be called having the event pool locked.
+ *
+ * Returns:
+ *    0: Success
+ * Else: Out of memory
+ */
+static uint8_t
+umidi20_event_pool_grow(void)
+{
+	struct umidi20_event_page *page;
+	uint32_t x;
+
+	page = malloc(sizeof(*page));
+	if (page == NULL)
+		return (1);
+
+	for (x = 0; x != UMIDI20_EVENT_PAGE; x++) {
+		page->event[x].p_next = umidi20_event_pool.free;
+		umidi20_event_pool.free = &page->event[x];
+	}
+	page->next = umidi20_event_pool.pages;
+	umidi20_event_pool.pages = page;
+
+	umidi20_event_pool.stats.pages++;
+	umidi20_event_pool.stats.total += UMIDI20_EVENT_PAGE;
+	umidi20_event_pool.stats.free += UMIDI20_EVENT_PAGE;
+	return (0);
+}
+
+/*
+ * Move up to "num" events from the shared pool into the given cache.
+ * Must be called having the event pool locked.
+ */
+static void
+umidi20_event_cache_refill(struct umidi20_event_cache *cache, uint32_t num)
+{
+	struct umidi20_event *event;
+	uint32_t used;
+
+	while (num--) {
+		event = umidi20_event_pool.free;
+		if (event == NULL) {
+			if (umidi20_event_pool_grow())
+				break;
+			event = umidi20_event_pool.free;
+		}
+		umidi20_event_pool.free = event->p_next;
+		umidi20_event_pool.stats.free--;
+
+		event->p_next = cache->free;
+		cache->free = event;
+		__atomic_store_n(&cache->num, cache->num + 1, __ATOMIC_RELAXED);
+	}
+
+	used = umidi20_event_pool.stats.total - umidi20_event_pool.stats.free;
+	if (used > umidi20_event_pool.stats.used_max)
+		umidi20_event_pool.stats.used_max = used;
+}
+
+/*
+ * Move all but "num" events from the given cache into the shared pool.
+ * Must be called having the event pool locked.
+ */
+static void
+umidi20_event_cache_drain(struct umidi20_event_cache *cache, uint32_t num)
+{
+	struct umidi20_event *event;
+
+	while (cache->num > num) {
+		event = cache->free;
+		cache->free = event->p_next;
+		__atomic_store_n(&cache->num, cache->num - 1, __ATOMIC_RELAXED);
+
+		event->p_next = umidi20_event_pool.free;
+		umidi20_event_pool.free = event;
+		umidi20_event_pool.stats.free++;
+	}
+}
+
+static void
+umidi20_event_cache_destroy(void *arg)
+{
+	struct umidi20_event_cache *cache = arg;
+
+	pthread_mutex_lock(&umidi20_event_pool.mtx);
+	umidi20_event_cache_drain(cache, 0);
+	TAILQ_REMOVE(&umidi20_event_pool.caches, cache, entry);
+	umidi20_event_pool.stats.threads--;
+	pthread_mutex_unlock(&umidi20_event_pool.mtx);
+
+	free(cache);
+}
+
+static void
+umidi20_event_cache_init(void)
+{
+	if (pthread_key_create(&umidi20_event_pool.key,
+	    &umidi20_event_cache_destroy) != 0)
+		abort();
+}
+
+static struct umidi20_event_cache *
+umidi20_event_cache_get(void)
+{
+	struct umidi20_event_cache *cache;
+
+	pthread_once(&umidi20_event_pool.once, &umidi20_event_cache_init);
+
+	cache = pthread_getspecific(umidi20_event_pool.key);
+	if (cache != NULL)
+		return (cache);
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return (NULL);
+
+	if (pthread_setspecific(umidi20_event_pool.key, cache) != 0) {
+		free(cache);
+		return (NULL);
+	}
+	pthread_mutex_lock(&umidi20_event_pool.mtx);
+	TAILQ_INSERT_TAIL(&umidi20_event_pool.caches, cache, entry);
+	umidi20_event_pool.stats.threads++;
+	pthread_mutex_unlock(&umidi20_event_pool.mtx);
+
+	return (cache);
+}
+
 /*
  * flag: 0 - default
  *       1 - use cache
+ *
+ * All events are allocated from the calling thread's event cache,
+ * regardless of the flag value.
  */
 struct umidi20_event *
 umidi20_event_alloc(struct umidi20_event ***ppp_next, uint8_t flag)
 {
-	struct umidi20_event *event = NULL;
+	struct umidi20_event_cache *cache;
+	struct umidi20_event *event;
 
-	if (flag == 1) {
-		pthread_mutex_lock(&root_dev.mutex);
-		UMIDI20_IF_DEQUEUE(&(root_dev.free_queue), event);
-		pthread_mutex_unlock(&root_dev.mutex);
-	}
-	if (event == NULL) {
-		event = malloc(sizeof(*event));
+	cache = umidi20_event_cache_get();
+	if (cache == NULL)
+		goto fail;
+
+	if (cache->num == 0) {
+		pthread_mutex_lock(&umidi20_event_pool.mtx);
+		umidi20_event_cache_refill(cache, UMIDI20_EVENT_CACHE / 2);
+		pthread_mutex_unlock(&umidi20_event_pool.mtx);
+
+		if (cache->num == 0)
+			goto fail;
 	}
-	if (event) {
-		memset(event, 0, sizeof(*event));
-		if (ppp_next) {
-			**ppp_next = event;
-			*ppp_next = &(event->p_next);
-		}
+	event = cache->free;
+	cache->free = event->p_next;
+	__atomic_store_n(&cache->num, cache->num - 1, __ATOMIC_RELAXED);
+
+	memset(event, 0, sizeof(*event));
+	if (ppp_next) {
+		**ppp_next = event;
+		*ppp_next = &(event->p_next);
 	}
 	return event;
+
+fail:
+	pthread_mutex_lock(&umidi20_event_pool.mtx);
+	umidi20_event_pool.stats.failed++;
+	pthread_mutex_unlock(&umidi20_event_pool.mtx);
+	return NULL;
 }
 
 void
 umidi20_event_free(struct umidi20_event *event)
 {
-	struct umidi20_event *p_next;
+	struct umidi20_event_cache *cache;
+	struct umidi20_event *last;
+	uint32_t num;
 
-	while (event) {
-		p_next = event->p_next;
-		free(event);
-		event = p_next;
+	if (event == NULL)
+		return;
+
+	/* the "p_next" chain is reused as free list */
+	for (num = 1, last = event; last->p_next != NULL; num++)
+		last = last->p_next;
+
+	cache = umidi20_event_cache_get();
+	if (cache == NULL) {
+		pthread_mutex_lock(&umidi20_event_pool.mtx);
+		last->p_next = umidi20_event_pool.free;
+		umidi20_event_pool.free = event;
+		umidi20_event_pool.stats.free += num;
+		pthread_mutex_unlock(&umidi20_event_pool.mtx);
+		return;
 	}
+	last->p_next = cache->free;
+	cache->free = event;
+	__atomic_store_n(&cache->num, cache->num + num, __ATOMIC_RELAXED);
+
+	if (cache->num > UMIDI20_EVENT_CACHE) {
+		pthread_mutex_lock(&umidi20_event_pool.mtx);
+		umidi20_event_cache_drain(cache, UMIDI20_EVENT_CACHE / 2);
+		pthread_mutex_unlock(&umidi20_event_pool.mtx);
+	}
+}
+
+void
+umidi20_event_get_stats(struct umidi20_event_stats *stats)
+{
+	struct umidi20_event_cache *cache;
+
+	pthread_mutex_lock(&umidi20_event_pool.mtx);
+	*stats = umidi20_event_pool.stats;
+	stats->cached = 0;
+	TAILQ_FOREACH(cache, &umidi20_event_pool.caches, entry)
+		stats->cached += __atomic_load_n(&cache->num, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&umidi20_event_pool.mtx);
+
+	stats->used = stats->total - stats->free - stats->cached;
 }
 
 struct umidi20_event *
@@ -754,6 +1929,7 @@ umidi20_event_copy(struct umidi20_event *event, uint8_t flag)
 		/* copy data */
 
 		p_curr->position = event->position;
+		p_curr->position_frac = event->position_frac;
 		p_curr->revision = event->revision;
 		p_curr->tick = event->tick;
 		p_curr->device_no = event->device_no;
@@ -834,6 +2010,20 @@ umidi20_event_pointer(struct umidi20_event *event, uint32_t offset)
 	}
 }
 
+uint64_t
+umidi20_event_get_position_fine(struct umidi20_event *event)
+{
+	return (((uint64_t)event->position << UMIDI20_POSITION_FINE_SHIFT) |
+	    event->position_frac);
+}
+
+void
+umidi20_event_set_position_fine(struct umidi20_event *event, uint64_t position)
+{
+	event->position = position >> UMIDI20_POSITION_FINE_SHIFT;
+	event->position_frac = position;
+}
+
 uint32_t
 umidi20_event_get_what(struct umidi20_event *event)
 {
@@ -1302,70 +2492,363 @@ umidi20_event_set_tempo(struct umidi20_event *event,
 	event->cmd[0] = 6;		/* bytes */
 }
 
-struct umidi20_event *
-umidi20_event_queue_search(struct umidi20_event_queue *queue,
-    uint32_t position, uint8_t cache_no)
+static uint8_t
+umidi20_event_index_level(struct umidi20_event_index *index)
 {
-	struct umidi20_event *event = queue->ifq_cache[cache_no];
-
-	if (event == NULL) {
-		UMIDI20_IF_POLL_HEAD(queue, event);
-		if (event == NULL) {
-			goto done;
-		}
-	}
-	while (1) {
-		if (event->position < position) {
-			break;
-		}
-		if (event->p_prevpkt == NULL) {
-			break;
-		}
-		event = event->p_prevpkt;
+	uint32_t r = index->seed;
+	uint8_t level = 1;
+
+	/* xorshift */
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	index->seed = r;
+
+	/* one in four nodes is promoted to the next level */
+	while ((r & 3) == 0 && level < UMIDI20_INDEX_LEVELS) {
+		level++;
+		r >>= 2;
 	}
+	return (level);
+}
 
-	while (1) {
-		if (event->position >= position) {
-			queue->ifq_cache[cache_no] = event;
-			goto done;
-		}
-		if (event->p_nextpkt == NULL) {
-			queue->ifq_cache[cache_no] = event;
-			event = NULL;
-			goto done;
+/*
+ * Returns the last node having a position less than the given
+ * one, or NULL. If "update" is not NULL, it receives the array of
+ * next pointers preceding the given position, for every level.
+ */
+static struct umidi20_event_index_node *
+umidi20_event_index_find(struct umidi20_event_index *index,
+    uint32_t position, struct umidi20_event_index_node ***update)
+{
+	struct umidi20_event_index_node **pnext = index->next;
+	struct umidi20_event_index_node *node = NULL;
+	int x;
+
+	for (x = UMIDI20_INDEX_LEVELS - 1; x >= 0; x--) {
+		while (pnext[x] != NULL && pnext[x]->position < position) {
+			node = pnext[x];
+			pnext = node->next;
 		}
-		event = event->p_nextpkt;
+		if (update != NULL)
+			update[x] = pnext;
 	}
-done:
-	return event;
+	return (node);
 }
 
-void
-umidi20_event_queue_copy(struct umidi20_event_queue *src,
-    struct umidi20_event_queue *dst,
-    uint32_t pos_a, uint32_t pos_b,
-    uint16_t rev_a, uint16_t rev_b,
-    uint8_t cache_no, uint8_t flag)
+static struct umidi20_event_index_node *
+umidi20_event_index_node_alloc(struct umidi20_event_index *index,
+    uint32_t position)
 {
-	struct umidi20_event *event_a;
-	struct umidi20_event *event_b;
-	struct umidi20_event *event_n;
+	struct umidi20_event_index_node *node;
+	uint8_t level;
 
-	if (pos_b < pos_a) {
-		pos_b = -1;
-	}
-	event_a = umidi20_event_queue_search(src, pos_a, cache_no);
-	event_b = umidi20_event_queue_search(src, pos_b, cache_no);
+	level = umidi20_event_index_level(index);
 
-	while (event_a != event_b) {
+	node = malloc(sizeof(*node) + (level * sizeof(node->next[0])));
+	if (node == NULL)
+		return (NULL);
 
-		if ((event_a->revision >= rev_a) &&
-		    (event_a->revision < rev_b)) {
+	node->last = NULL;
+	node->position = position;
+	node->level = level;
+	return (node);
+}
 
-			event_n = umidi20_event_copy(event_a, flag);
+static void
+umidi20_event_index_clear(struct umidi20_event_index *index)
+{
+	struct umidi20_event_index_node *node;
+	struct umidi20_event_index_node *node_next;
 
-			if (event_n) {
-				umidi20_event_queue_insert(dst, event_n, cache_no);
+	for (node = index->next[0]; node != NULL; node = node_next) {
+		node_next = node->next[0];
+		free(node);
+	}
+	memset(index->next, 0, sizeof(index->next));
+}
+
+/*
+ * Build the index from a sorted queue.
+ *
+ * Returns:
+ *    0: Success
+ * Else: Out of memory
+ */
+static uint8_t
+umidi20_event_index_build(struct umidi20_event_queue *queue)
+{
+	struct umidi20_event_index *index = queue->ifq_index;
+	struct umidi20_event_index_node **tail[UMIDI20_INDEX_LEVELS];
+	struct umidi20_event_index_node *node = NULL;
+	struct umidi20_event *event;
+	uint8_t x;
+
+	for (x = 0; x != UMIDI20_INDEX_LEVELS; x++)
+		tail[x] = index->next;
+
+	UMIDI20_QUEUE_FOREACH(event, queue) {
+		if (node == NULL || node->position != event->position) {
+			node = umidi20_event_index_node_alloc(index, event->position);
+			if (node == NULL)
+				return (1);
+			for (x = 0; x != node->level; x++) {
+				node->next[x] = NULL;
+				tail[x][x] = node;
+				tail[x] = node->next;
+			}
+		}
+		node->last = event;
+	}
+	return (0);
+}
+
+/*
+ * Rebuild the index after the event positions have been changed
+ * in place.
+ */
+static void
+umidi20_event_index_rebuild(struct umidi20_event_queue *queue)
+{
+	if (queue->ifq_index == NULL)
+		return;
+
+	umidi20_event_index_clear(queue->ifq_index);
+
+	if (umidi20_event_index_build(queue))
+		umidi20_event_queue_set_indexed(queue, 0);
+}
+
+/*
+ * Returns the index node for the given position, creating it if
+ * needed, and the first event having a greater position through
+ * "pevent". Returns NULL if out of memory.
+ */
+static struct umidi20_event_index_node *
+umidi20_event_index_insert(struct umidi20_event_queue *queue,
+    uint32_t position, struct umidi20_event **pevent)
+{
+	struct umidi20_event_index *index = queue->ifq_index;
+	struct umidi20_event_index_node **update[UMIDI20_INDEX_LEVELS];
+	struct umidi20_event_index_node *node;
+	struct umidi20_event_index_node *node_eq;
+	uint8_t x;
+
+	node = umidi20_event_index_find(index, position, update);
+	node_eq = update[0][0];
+
+	if (node_eq != NULL && node_eq->position == position) {
+		*pevent = node_eq->last->p_nextpkt;
+		return (node_eq);
+	}
+	if (node != NULL)
+		*pevent = node->last->p_nextpkt;
+	else
+		*pevent = queue->ifq_head;
+
+	node_eq = umidi20_event_index_node_alloc(index, position);
+	if (node_eq == NULL)
+		return (NULL);
+
+	for (x = 0; x != node_eq->level; x++) {
+		node_eq->next[x] = update[x][x];
+		update[x][x] = node_eq;
+	}
+	return (node_eq);
+}
+
+/*
+ * Enable or disable the position index of an event queue. When the
+ * index is enabled, search and insert complete in logarithmic time
+ * and events must only be removed using
+ * umidi20_event_queue_remove(). Events must not change position
+ * while queued.
+ *
+ * Returns:
+ *    0: Success
+ * Else: Out of memory
+ */
+uint8_t
+umidi20_event_queue_set_indexed(struct umidi20_event_queue *queue, uint8_t on)
+{
+	struct umidi20_event_index *index = queue->ifq_index;
+
+	if (on == 0) {
+		if (index != NULL) {
+			umidi20_event_index_clear(index);
+			free(index);
+			queue->ifq_index = NULL;
+		}
+		return (0);
+	}
+	if (index != NULL)
+		return (0);
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL)
+		return (1);
+
+	index->seed = 0x9E3779B9;
+	queue->ifq_index = index;
+
+	if (umidi20_event_index_build(queue)) {
+		umidi20_event_queue_set_indexed(queue, 0);
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Record that the given event was inserted into or removed from a
+ * track queue.
+ */
+static void
+umidi20_event_queue_changed(struct umidi20_event_queue *queue,
+    struct umidi20_event *event, int32_t delta)
+{
+	struct umidi20_track_stats *stats = queue->ifq_stats;
+	uint8_t key;
+	uint8_t meta_num;
+
+	if (stats == NULL)
+		return;
+
+	stats->changes++;
+
+	/* the position of inserted events may not be computed yet */
+	if (stats->dirty_tick > event->tick)
+		stats->dirty_tick = event->tick;
+	if (stats->dirty_position > event->position)
+		stats->dirty_position = event->position;
+
+	if (stats->dirty_lo > event->position)
+		stats->dirty_lo = event->position;
+	if (stats->dirty_hi < event->position)
+		stats->dirty_hi = event->position;
+
+	if (umidi20_event_get_what(event) & UMIDI20_WHAT_KEY) {
+		key = umidi20_event_get_key(event) & 0x7F;
+		stats->key_count[key] += delta;
+		if (delta < 0 && stats->open_event[key] == event)
+			stats->open_event[key] = NULL;
+		if (umidi20_event_is_key_start(event) ||
+		    umidi20_event_is_key_end(event))
+			stats->dirty_keys[key / 8] |= (1 << (key % 8));
+	} else if (umidi20_event_is_meta(event)) {
+		meta_num = umidi20_event_get_meta_number(event);
+		if (meta_num == 0x03 || meta_num == 0x04)
+			stats->meta_dirty = 1;
+		else if (meta_num == 0x51)
+			stats->tempo_dirty = 1;
+	}
+}
+
+void
+umidi20_event_queue_remove(struct umidi20_event_queue *queue,
+    struct umidi20_event *event)
+{
+	struct umidi20_event_index_node **update[UMIDI20_INDEX_LEVELS];
+	struct umidi20_event_index_node *node;
+	uint8_t x;
+
+	if (queue->ifq_index != NULL) {
+		umidi20_event_index_find(queue->ifq_index, event->position, update);
+		node = update[0][0];
+
+		if (node != NULL && node->last == event) {
+			if (event->p_prevpkt != NULL &&
+			    event->p_prevpkt->position == event->position) {
+				node->last = event->p_prevpkt;
+			} else {
+				for (x = 0; x != node->level; x++)
+					update[x][x] = node->next[x];
+				free(node);
+			}
+		}
+	}
+	UMIDI20_IF_REMOVE(queue, event);
+
+	umidi20_event_queue_changed(queue, event, -1);
+}
+
+struct umidi20_event *
+umidi20_event_queue_search(struct umidi20_event_queue *queue,
+    uint32_t position, uint8_t cache_no)
+{
+	struct umidi20_event_index_node *node;
+	struct umidi20_event *event = queue->ifq_cache[cache_no];
+
+	if (queue->ifq_index != NULL) {
+		node = umidi20_event_index_find(queue->ifq_index, position, NULL);
+		if (node != NULL)
+			event = node->last->p_nextpkt;
+		else
+			UMIDI20_IF_POLL_HEAD(queue, event);
+		if (event != NULL)
+			queue->ifq_cache[cache_no] = event;
+		else
+			queue->ifq_cache[cache_no] = queue->ifq_tail;
+		goto done;
+	}
+
+	if (event == NULL) {
+		UMIDI20_IF_POLL_HEAD(queue, event);
+		if (event == NULL) {
+			goto done;
+		}
+	}
+	while (1) {
+		if (event->position < position) {
+			break;
+		}
+		if (event->p_prevpkt == NULL) {
+			break;
+		}
+		event = event->p_prevpkt;
+	}
+
+	while (1) {
+		if (event->position >= position) {
+			queue->ifq_cache[cache_no] = event;
+			goto done;
+		}
+		if (event->p_nextpkt == NULL) {
+			queue->ifq_cache[cache_no] = event;
+			event = NULL;
+			goto done;
+		}
+		event = event->p_nextpkt;
+	}
+done:
+	return event;
+}
+
+void
+umidi20_event_queue_copy(struct umidi20_event_queue *src,
+    struct umidi20_event_queue *dst,
+    uint32_t pos_a, uint32_t pos_b,
+    uint16_t rev_a, uint16_t rev_b,
+    uint8_t cache_no, uint8_t flag)
+{
+	struct umidi20_event *event_a;
+	struct umidi20_event *event_b;
+	struct umidi20_event *event_n;
+
+	if (pos_b < pos_a) {
+		pos_b = -1;
+	}
+	event_a = umidi20_event_queue_search(src, pos_a, cache_no);
+	event_b = umidi20_event_queue_search(src, pos_b, cache_no);
+
+	while (event_a != event_b) {
+
+		if ((event_a->revision >= rev_a) &&
+		    (event_a->revision < rev_b)) {
+
+			event_n = umidi20_event_copy(event_a, flag);
+
+			if (event_n) {
+				umidi20_event_queue_insert(dst, event_n, cache_no);
 			} else {
 				/* XXX do what */
 			}
@@ -1398,7 +2881,7 @@ umidi20_event_queue_move(struct umidi20_event_queue *src,
 		if ((event_a->revision >= rev_a) &&
 		    (event_a->revision < rev_b)) {
 
-			UMIDI20_IF_REMOVE(src, event_a);
+			umidi20_event_queue_remove(src, event_a);
 
 			if (dst) {
 				umidi20_event_queue_insert(dst, event_a, cache_no);
@@ -1415,8 +2898,30 @@ umidi20_event_queue_insert(struct umidi20_event_queue *dst,
     struct umidi20_event *event_n,
     uint8_t cache_no)
 {
-	struct umidi20_event *event_a =
-	umidi20_event_queue_search(dst, event_n->position + 1, cache_no);
+	struct umidi20_event_index_node *node = NULL;
+	struct umidi20_event *event_a;
+	struct umidi20_event *event_b;
+
+	if (dst->ifq_index != NULL) {
+		node = umidi20_event_index_insert(dst, event_n->position, &event_a);
+		if (node == NULL)
+			umidi20_event_queue_set_indexed(dst, 0);
+	}
+	if (node == NULL)
+		event_a = umidi20_event_queue_search(dst, event_n->position + 1, cache_no);
+
+	/* order events within the same millisecond by fraction */
+	if (event_a == NULL)
+		UMIDI20_IF_POLL_TAIL(dst, event_b);
+	else
+		event_b = event_a->p_prevpkt;
+
+	while (event_b != NULL &&
+	    event_b->position == event_n->position &&
+	    event_b->position_frac > event_n->position_frac) {
+		event_a = event_b;
+		event_b = event_b->p_prevpkt;
+	}
 
 	if (event_a == NULL) {
 		/* queue at end */
@@ -1425,6 +2930,65 @@ umidi20_event_queue_insert(struct umidi20_event_queue *dst,
 		/* queue before event */
 		UMIDI20_IF_ENQUEUE_BEFORE(dst, event_a, event_n);
 	}
+
+	if (node != NULL && (event_n->p_nextpkt == NULL ||
+	    event_n->p_nextpkt->position != event_n->position))
+		node->last = event_n;
+
+	umidi20_event_queue_changed(dst, event_n, 1);
+}
+
+/*
+ * Move all events of the sorted queue "src" into the sorted queue
+ * "dst" in a single pass. Events at the same position are ordered
+ * like umidi20_event_queue_insert() does.
+ */
+void
+umidi20_event_queue_merge(struct umidi20_event_queue *dst,
+    struct umidi20_event_queue *src, uint8_t cache_no)
+{
+	struct umidi20_event *event_a = NULL;
+	struct umidi20_event *event_n;
+	struct umidi20_event *event_last = NULL;
+
+	while (1) {
+
+		UMIDI20_IF_POLL_HEAD(src, event_n);
+
+		if (event_n == NULL) {
+			break;
+		}
+		umidi20_event_queue_remove(src, event_n);
+
+		if (dst->ifq_index != NULL) {
+			umidi20_event_queue_insert(dst, event_n, cache_no);
+			continue;
+		}
+		/* search again, if "src" is not sorted */
+		if (event_last == NULL ||
+		    event_n->position < event_last->position ||
+		    (event_n->position == event_last->position &&
+		    event_n->position_frac < event_last->position_frac)) {
+			event_a = umidi20_event_queue_search(dst,
+			    event_n->position, cache_no);
+		}
+		while (event_a != NULL &&
+		    (event_a->position < event_n->position ||
+		    (event_a->position == event_n->position &&
+		    event_a->position_frac <= event_n->position_frac))) {
+			event_a = event_a->p_nextpkt;
+		}
+		if (event_a == NULL) {
+			UMIDI20_IF_ENQUEUE_LAST(dst, event_n);
+		} else {
+			UMIDI20_IF_ENQUEUE_BEFORE(dst, event_a, event_n);
+		}
+		umidi20_event_queue_changed(dst, event_n, 1);
+
+		event_last = event_n;
+	}
+	if (event_last != NULL && dst->ifq_index == NULL)
+		dst->ifq_cache[cache_no] = event_last;
 }
 
 void
@@ -1441,6 +3005,17 @@ umidi20_event_queue_drain(struct umidi20_event_queue *src)
 		}
 		umidi20_event_free(event);
 	}
+	if (src->ifq_index != NULL)
+		umidi20_event_index_clear(src->ifq_index);
+
+	if (src->ifq_stats != NULL) {
+		memset(src->ifq_stats->key_count, 0,
+		    sizeof(src->ifq_stats->key_count));
+		memset(src->ifq_stats->open_event, 0,
+		    sizeof(src->ifq_stats->open_event));
+		src->ifq_stats->valid = 0;
+		src->ifq_stats->changes++;
+	}
 }
 
 /*
@@ -1753,6 +3328,22 @@ umidi20_difftime(struct timespec *a, struct timespec *b)
 	return ((c.tv_sec * 1000) + (c.tv_nsec / 1000000));
 }
 
+uint64_t
+umidi20_difftime_fine(struct timespec *a, struct timespec *b)
+{
+	struct timespec c;
+
+	c.tv_sec = a->tv_sec - b->tv_sec;
+	c.tv_nsec = a->tv_nsec - b->tv_nsec;
+
+	if (a->tv_nsec < b->tv_nsec) {
+		c.tv_sec -= 1;
+		c.tv_nsec += 1000000000;
+	}
+	return (((uint64_t)c.tv_sec << UMIDI20_POSITION_FINE_SHIFT) * 1000 +
+	    (((uint64_t)c.tv_nsec << UMIDI20_POSITION_FINE_SHIFT) / 1000000));
+}
+
 int
 umidi20_mutex_init(pthread_mutex_t *pmutex)
 {
@@ -1768,9 +3359,11 @@ umidi20_device_start(struct umidi20_device *dev,
     uint32_t start_position,
     uint32_t end_offset)
 {
+	pthread_mutex_lock(&dev->mtx);
 	dev->start_position = start_position;
 	dev->end_offset = end_offset;
 	dev->enabled_usr = 1;
+	pthread_mutex_unlock(&dev->mtx);
 }
 
 static void
@@ -1780,9 +3373,12 @@ umidi20_device_stop(struct umidi20_device *dev, struct umidi20_pipe **ppipe)
 	uint8_t buf[4];
 	uint8_t timeout = 16;
 
+	pthread_mutex_lock(&dev->mtx);
 	dev->enabled_usr = 0;
-	umidi20_convert_reset(&(dev->conv));
 	umidi20_event_queue_drain(&(dev->queue));
+	pthread_mutex_unlock(&dev->mtx);
+
+	umidi20_convert_reset(&(dev->conv));
 
 	if (ppipe == NULL)
 		return;
@@ -1816,54 +3412,34 @@ umidi20_device_stop(struct umidi20_device *dev, struct umidi20_pipe **ppipe)
 	}
 }
 
+/*
+ * Move all recorded events of the given device into the given
+ * queue, which must be empty.
+ */
 static void
-umidi20_put_queue(uint8_t device_no,
-    struct umidi20_event *event)
-{
-	struct umidi20_device *dev;
-
-	if (device_no >= UMIDI20_N_DEVICES) {
-		umidi20_event_free(event);
-		return;
-	}
-	pthread_mutex_lock(&root_dev.mutex);
-
-	dev = &(root_dev.play[device_no]);
-
-	if (dev->enabled_usr &&
-	    dev->enabled_cfg) {
-		umidi20_event_queue_insert
-		    (&(dev->queue), event, UMIDI20_CACHE_INPUT);
-	} else {
-		umidi20_event_free(event);
-	}
-
-	pthread_mutex_unlock(&root_dev.mutex);
-}
-
-static struct umidi20_event *
-umidi20_get_queue(uint8_t device_no)
+umidi20_get_queue(uint8_t device_no, struct umidi20_event_queue *queue)
 {
 	struct umidi20_device *dev;
 	struct umidi20_event *event;
 
 	if (device_no >= UMIDI20_N_DEVICES) {
-		return NULL;
+		return;
 	}
-	pthread_mutex_lock(&root_dev.mutex);
-
 	dev = &(root_dev.rec[device_no]);
 
+	pthread_mutex_lock(&dev->mtx);
+
 	if (dev->enabled_usr &&
 	    dev->enabled_cfg) {
-		UMIDI20_IF_DEQUEUE(&(dev->queue), event);
-	} else {
-		event = NULL;
+		while (1) {
+			UMIDI20_IF_DEQUEUE(&(dev->queue), event);
+			if (event == NULL)
+				break;
+			UMIDI20_IF_ENQUEUE_LAST(queue, event);
+		}
 	}
 
-	pthread_mutex_unlock(&root_dev.mutex);
-
-	return event;
+	pthread_mutex_unlock(&dev->mtx);
 }
 
 void
@@ -1886,7 +3462,7 @@ umidi20_start(uint32_t start_offset, uint32_t end_offset, uint8_t flag)
 	    (end_offset > 0x80000000)) {
 		goto done;
 	}
-	start_position = (root_dev.curr_position - start_offset);
+	start_position = (umidi20_get_curr_position() - start_offset);
 
 	if (flag & UMIDI20_FLAG_PLAY) {
 		for (x = 0; x < UMIDI20_N_DEVICES; x++) {
@@ -1900,6 +3476,7 @@ umidi20_start(uint32_t start_offset, uint32_t end_offset, uint8_t flag)
 			    (&(root_dev.rec[x]), start_position, end_offset);
 		}
 	}
+	umidi20_wakeup();
 done:
 	pthread_mutex_unlock(&root_dev.mutex);
 }
@@ -1969,6 +3546,9 @@ umidi20_song_alloc(pthread_mutex_t *p_mtx, uint16_t file_format,
 		memset(song, 0, sizeof(*song));
 
 		song->p_mtx = p_mtx;
+		song->play_lookahead = UMIDI20_LOOKAHEAD_DEF;
+
+		umidi20_wakeup_init(&(song->wakeup));
 
 		if (pthread_create(&(song->thread_io), NULL,
 		    &umidi20_watchdog_song, song)) {
@@ -1982,129 +3562,797 @@ umidi20_song_alloc(pthread_mutex_t *p_mtx, uint16_t file_format,
 		}
 		song->midi_resolution = resolution;
 		song->midi_division_type = div_type;
+
+		/* the tempo map is built when needed */
+		song->tempo_map_num = 0;
+	}
+	return song;
+}
+
+void
+umidi20_song_free(struct umidi20_song *song)
+{
+	struct umidi20_track *track;
+
+	if (song == NULL) {
+		return;
+	}
+	pthread_mutex_assert(song->p_mtx, MA_OWNED);
+
+	umidi20_song_wakeup(song);
+	umidi20_stop_thread(&(song->thread_io), song->p_mtx);
+	umidi20_wakeup_destroy(&(song->wakeup));
+
+	umidi20_song_stop(song, UMIDI20_FLAG_PLAY | UMIDI20_FLAG_RECORD);
+
+	while (1) {
+
+		UMIDI20_IF_DEQUEUE(&(song->queue), track);
+
+		if (track == NULL) {
+			break;
+		}
+		umidi20_track_free(track);
+	}
+
+	free(song->play_cursor);
+	free(song->play_heap);
+	free(song->tempo_map);
+	free(song);
+}
+
+/*
+ * Copy the events of a track in the range from "pos_a" inclusive to
+ * "pos_b" exclusive. If "key_end_only" is set, only the events
+ * stopping a key are copied.
+ */
+static void
+umidi20_track_copy_window(struct umidi20_track *track,
+    struct umidi20_event_queue *dst, uint32_t pos_a, uint32_t pos_b,
+    uint8_t key_end_only)
+{
+	struct umidi20_track_iter iter;
+	struct umidi20_event *event;
+	struct umidi20_event *event_n;
+
+	if (pos_b < pos_a) {
+		pos_b = -1;
+	}
+	for (event = umidi20_track_iter_seek(&iter, track, pos_a);
+	    event != NULL && event->position < pos_b;
+	    event = umidi20_track_iter_next(&iter)) {
+
+		if (key_end_only && !umidi20_event_is_key_end(event))
+			continue;
+
+		event_n = umidi20_event_copy(event, 0);
+		if (event_n != NULL) {
+			umidi20_event_queue_insert(dst, event_n,
+			    UMIDI20_CACHE_OUTPUT);
+		}
+	}
+}
+
+/*
+ * Returns non-zero if the two events have the same timing and the
+ * same content, and cannot be told apart when played.
+ */
+static uint8_t
+umidi20_event_is_same(struct umidi20_event *pa, struct umidi20_event *pb)
+{
+	if (pa->position != pb->position ||
+	    pa->position_frac != pb->position_frac ||
+	    pa->device_no != pb->device_no)
+		return (0);
+
+	while (pa != NULL && pb != NULL) {
+		if (memcmp(pa->cmd, pb->cmd, UMIDI20_COMMAND_LEN) != 0)
+			return (0);
+		pa = pa->p_next;
+		pb = pb->p_next;
+	}
+	return (pa == pb);
+}
+
+/*
+ * Remove the copies of the events of a track between the given
+ * positions from the device play queues, except the ones stopping a
+ * key. An identical event queued by another track or song may be
+ * removed instead, which plays the same.
+ */
+static void
+umidi20_track_remove_window(struct umidi20_track *track,
+    uint32_t pos_a, uint32_t pos_b)
+{
+	struct umidi20_track_iter iter;
+	struct umidi20_device *dev;
+	struct umidi20_event *event;
+	struct umidi20_event *event_q;
+
+	if (pos_b < pos_a) {
+		pos_b = -1;
+	}
+	for (event = umidi20_track_iter_seek(&iter, track, pos_a);
+	    event != NULL && event->position < pos_b;
+	    event = umidi20_track_iter_next(&iter)) {
+
+		if (umidi20_event_is_key_end(event) ||
+		    event->device_no >= UMIDI20_N_DEVICES)
+			continue;
+
+		dev = &(root_dev.play[event->device_no]);
+
+		pthread_mutex_lock(&dev->mtx);
+		for (event_q = umidi20_event_queue_search(&(dev->queue),
+		    event->position, UMIDI20_CACHE_INPUT);
+		    event_q != NULL && event_q->position == event->position;
+		    event_q = event_q->p_nextpkt) {
+			if (umidi20_event_is_same(event_q, event)) {
+				umidi20_event_queue_remove(&(dev->queue), event_q);
+				umidi20_event_free(event_q);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&dev->mtx);
+	}
+}
+
+/*
+ * Merge the given sorted queue into the play queue of the given
+ * device, locking the device once. Returns non-zero if the play and
+ * record thread needs a wakeup.
+ */
+static uint8_t
+umidi20_put_queue_locked(uint8_t device_no, struct umidi20_event_queue *queue)
+{
+	struct umidi20_device *dev;
+	struct umidi20_event *event;
+	uint8_t retval = 0;
+
+	UMIDI20_IF_POLL_HEAD(queue, event);
+	if (event == NULL)
+		return (0);
+
+	dev = &(root_dev.play[device_no]);
+
+	pthread_mutex_lock(&dev->mtx);
+	if (dev->enabled_usr &&
+	    dev->enabled_cfg) {
+		umidi20_event_queue_merge(&(dev->queue), queue,
+		    UMIDI20_CACHE_INPUT);
+		retval = (dev->queue.ifq_head == event);
+	}
+	pthread_mutex_unlock(&dev->mtx);
+
+	/* device is disabled */
+	umidi20_event_queue_drain(queue);
+
+	return (retval);
+}
+
+/*
+ * Move all events of the given sorted queue into the play queue of
+ * the given device, in a single pass and taking the device lock only
+ * once. Events for a disabled device are freed.
+ */
+void
+umidi20_put_queue_batch(uint8_t device_no, struct umidi20_event_queue *queue)
+{
+	if (device_no >= UMIDI20_N_DEVICES) {
+		umidi20_event_queue_drain(queue);
+		return;
+	}
+	if (umidi20_put_queue_locked(device_no, queue))
+		umidi20_wakeup();
+}
+
+/*
+ * Same like umidi20_put_queue_batch(), except that the device is
+ * given by each event.
+ */
+static void
+umidi20_put_queue_split(struct umidi20_event_queue *queue)
+{
+	struct umidi20_event_queue temp[UMIDI20_N_DEVICES];
+	struct umidi20_event *event;
+	uint8_t wakeup = 0;
+	uint8_t x;
+
+	if (queue->ifq_head == NULL)
+		return;
+
+	memset(temp, 0, sizeof(temp));
+
+	while (1) {
+		UMIDI20_IF_DEQUEUE(queue, event);
+
+		if (event == NULL)
+			break;
+
+		if (event->device_no >= UMIDI20_N_DEVICES)
+			umidi20_event_free(event);
+		else
+			UMIDI20_IF_ENQUEUE_LAST(&temp[event->device_no], event);
+	}
+
+	for (x = 0; x < UMIDI20_N_DEVICES; x++)
+		wakeup |= umidi20_put_queue_locked(x, &temp[x]);
+
+	if (wakeup)
+		umidi20_wakeup();
+}
+
+/*
+ * Returns the current song position of a playing song.
+ */
+static uint32_t
+umidi20_song_play_position(struct umidi20_song *song, uint32_t curr_position)
+{
+	return (curr_position - song->play_start_position +
+	    song->play_start_offset);
+}
+
+/*
+ * Feed the next lookahead window of the song into the device play
+ * queues and collect recorded events. Returns the fine position at
+ * which this function should be called again, or UINT64_MAX when
+ * only an explicit wakeup can produce more work.
+ */
+static uint64_t
+umidi20_watchdog_song_sub(struct umidi20_song *song)
+{
+	struct umidi20_track *track;
+	struct umidi20_event_queue queue;
+	uint64_t curr_position_fine;
+	uint64_t retval = UINT64_MAX;
+	uint64_t next;
+	uint32_t curr_position;
+	uint32_t position;
+	uint32_t delta;
+	uint32_t x;
+
+	pthread_mutex_assert(song->p_mtx, MA_OWNED);
+
+	memset(&queue, 0, sizeof(queue));
+
+	curr_position_fine = umidi20_get_curr_position_fine();
+	curr_position = curr_position_fine >> UMIDI20_POSITION_FINE_SHIFT;
+
+	track = song->queue.ifq_cache[UMIDI20_CACHE_INPUT];
+
+	/*
+	 * The recorded events are merged into the track queue, which is
+	 * empty while the track is packed. If the track cannot be
+	 * unpacked, the events are kept in the device queues until the
+	 * next poll.
+	 */
+	if (song->rec_enabled && track != NULL &&
+	    umidi20_track_unpack(track) == 0) {
+
+		for (x = 0; x < UMIDI20_N_DEVICES; x++) {
+
+			umidi20_get_queue(x, &queue);
+
+			umidi20_event_queue_merge(&(track->queue), &queue,
+			    UMIDI20_CACHE_INPUT);
+		}
+	}
+	if (song->rec_enabled) {
+		retval = curr_position_fine +
+		    ((uint64_t)UMIDI20_RECORD_POLL << UMIDI20_POSITION_FINE_SHIFT);
+	}
+	if (song->play_enabled && song->play_direct == 0) {
+
+		position = umidi20_song_play_position(song, curr_position);
+
+		/* refill when less than half the lookahead is queued */
+		delta = song->play_last_offset - position;
+		if (delta >= 0x80000000U || delta <= song->play_lookahead / 2) {
+
+			position += song->play_lookahead;
+
+			if (position >= song->play_end_offset) {
+				song->play_enabled = 0;
+				position = song->play_end_offset;
+			}
+			UMIDI20_QUEUE_FOREACH(track, &(song->queue)) {
+				if (track->mute_flag)
+					continue;
+				umidi20_track_copy_window(track, &queue,
+				    song->play_last_offset, position, 0);
+			}
+
+			song->play_last_offset = position;
+
+			umidi20_put_queue_split(&queue);
+
+			delta = song->play_lookahead;
+		}
+		if (song->play_enabled) {
+			delta -= song->play_lookahead / 2;
+			next = curr_position_fine +
+			    ((uint64_t)delta << UMIDI20_POSITION_FINE_SHIFT);
+			if (next < retval)
+				retval = next;
+		}
+	}
+	return (retval);
+}
+
+static void *
+umidi20_watchdog_song(void *arg)
+{
+	struct umidi20_song *song = arg;
+	uint64_t position;
+
+	pthread_mutex_lock(song->p_mtx);
+
+	while (song->thread_io != PTHREAD_NULL) {
+
+		position = umidi20_watchdog_song_sub(song);
+
+		pthread_mutex_unlock(song->p_mtx);
+
+		umidi20_wakeup_sleep(&(song->wakeup), position);
+
+		pthread_mutex_lock(song->p_mtx);
+	}
+
+	pthread_mutex_unlock(song->p_mtx);
+
+	return NULL;
+}
+
+/*
+ * Wake up the song feeder thread, for example after the song was
+ * started or after the set of tracks to play has changed.
+ */
+void
+umidi20_song_wakeup(struct umidi20_song *song)
+{
+	if (song == NULL)
+		return;
+
+	umidi20_wakeup_signal(&(song->wakeup));
+}
+
+/*
+ * Set how many milliseconds of the song are queued for playback
+ * ahead of the current position. A smaller lookahead makes the
+ * feeder thread run more often.
+ */
+void
+umidi20_song_set_lookahead(struct umidi20_song *song, uint32_t ms)
+{
+	if (song == NULL)
+		return;
+
+	pthread_mutex_assert(song->p_mtx, MA_OWNED);
+
+	if (ms < UMIDI20_LOOKAHEAD_MIN)
+		ms = UMIDI20_LOOKAHEAD_MIN;
+	else if (ms > 0x10000000U)
+		ms = 0x10000000U;
+
+	song->play_lookahead = ms;
+
+	umidi20_song_wakeup(song);
+}
+
+/*
+ * Mute or unmute a track. When the song is playing, the already
+ * queued part of the lookahead window is updated at once: unmuted
+ * events are queued and the queued copies of the muted events are
+ * removed, except the ones stopping a key, so that no notes are left
+ * hanging. Events queued by other tracks and songs are kept.
+ */
+void
+umidi20_song_set_mute(struct umidi20_song *song,
+    struct umidi20_track *track, uint8_t mute)
+{
+	struct umidi20_event_queue queue;
+	uint32_t position;
+
+	if (song == NULL || track == NULL)
+		return;
+
+	pthread_mutex_assert(song->p_mtx, MA_OWNED);
+
+	mute = (mute != 0);
+
+	if (track->mute_flag == mute)
+		return;
+
+	track->mute_flag = mute;
+
+	/* zero copy playback checks the mute flag for every event */
+	if ((song->pc_flags & UMIDI20_FLAG_PLAY) == 0 || song->play_direct)
+		return;
+
+	memset(&queue, 0, sizeof(queue));
+
+	/* events before this position may already have been played */
+	position = umidi20_song_play_position(song,
+	    umidi20_get_curr_position()) + 1;
+
+	if (position - song->play_start_offset >=
+	    song->play_last_offset - song->play_start_offset)
+		return;
+
+	if (mute == 0) {
+		umidi20_track_copy_window(track, &queue,
+		    position, song->play_last_offset, 0);
+		umidi20_put_queue_split(&queue);
+	} else {
+		umidi20_track_remove_window(track,
+		    position, song->play_last_offset);
+	}
+}
+
+/*
+ * Zero copy playback: instead of copying the events into the device
+ * play queues, the play and record thread keeps a cursor per track
+ * in a heap ordered by the position of the next event, and passes
+ * the events of the tracks directly to the devices. It only does so
+ * while it can get the song lock without waiting. The heap is keyed
+ * on positions cached in the cursors, because the events of changed
+ * tracks may have been freed.
+ */
+static uint8_t
+umidi20_song_cursor_before(struct umidi20_song_cursor *pa,
+    struct umidi20_song_cursor *pb)
+{
+	if (pa->position != pb->position)
+		return (pa->position < pb->position);
+	if (pa->position_frac != pb->position_frac)
+		return (pa->position_frac < pb->position_frac);
+	/* keep the track order for events at the same position */
+	return (pa < pb);
+}
+
+static void
+umidi20_song_heap_fix(struct umidi20_song *song, uint32_t x)
+{
+	struct umidi20_song_cursor **heap = song->play_heap;
+	struct umidi20_song_cursor *temp;
+	uint32_t y;
+
+	while (x != 0) {
+		y = (x - 1) / 2;
+		if (!umidi20_song_cursor_before(heap[x], heap[y]))
+			break;
+		temp = heap[x];
+		heap[x] = heap[y];
+		heap[y] = temp;
+		x = y;
+	}
+	while (1) {
+		y = (2 * x) + 1;
+		if (y >= song->play_heap_num)
+			break;
+		if (y + 1 < song->play_heap_num &&
+		    umidi20_song_cursor_before(heap[y + 1], heap[y]))
+			y++;
+		if (!umidi20_song_cursor_before(heap[y], heap[x]))
+			break;
+		temp = heap[x];
+		heap[x] = heap[y];
+		heap[y] = temp;
+		x = y;
+	}
+}
+
+static void
+umidi20_song_cursor_set(struct umidi20_song_cursor *pc,
+    struct umidi20_event *event)
+{
+	pc->event = event;
+	if (event != NULL) {
+		pc->position = event->position;
+		pc->position_frac = event->position_frac;
+	}
+}
+
+/*
+ * Seek the given cursor to the first event which was not played yet
+ * and which is not before the given position.
+ */
+static void
+umidi20_song_cursor_seek(struct umidi20_song *song,
+    struct umidi20_song_cursor *pc, struct umidi20_track *track,
+    uint32_t min_pos)
+{
+	struct umidi20_event *event;
+	uint32_t position;
+
+	if (song->play_done_valid)
+		position = song->play_done_pos;
+	else
+		position = song->play_start_offset;
+	if (position < min_pos)
+		position = min_pos;
+
+	for (event = umidi20_track_iter_seek(&pc->iter, track, position);
+	    event != NULL && song->play_done_valid &&
+	    event->position == song->play_done_pos &&
+	    event->position_frac <= song->play_done_frac;
+	    event = umidi20_track_iter_next(&pc->iter))
+		;
+
+	umidi20_song_cursor_set(pc, event);
+	pc->changes = track->stats.changes;
+}
+
+/*
+ * Returns the first position at which changed events of the given
+ * track may be played. Events just recorded into the record track
+ * are not played back.
+ */
+static uint32_t
+umidi20_song_play_min(struct umidi20_song *song,
+    struct umidi20_track *track, uint64_t position_fine)
+{
+	if (song->rec_enabled &&
+	    track == song->queue.ifq_cache[UMIDI20_CACHE_INPUT]) {
+		return (umidi20_song_play_position(song,
+		    position_fine >> UMIDI20_POSITION_FINE_SHIFT) + 1);
+	}
+	return (0);
+}
+
+/*
+ * Seek the cursors of all tracks changed since their cursor was last
+ * used, and rebuild the heap if any cursor moved. After this all
+ * cursors point to valid events, until the song is unlocked. Must be
+ * called having the song locked.
+ */
+static void
+umidi20_song_play_revalidate(struct umidi20_song *song,
+    uint64_t position_fine)
+{
+	struct umidi20_song_cursor *pc;
+	struct umidi20_track *track;
+	uint32_t x;
+	uint8_t changed = 0;
+
+	for (x = 0; x != song->play_cursor_num; x++) {
+		pc = song->play_cursor + x;
+		track = pc->iter.track;
+		if (pc->changes == track->stats.changes)
+			continue;
+		umidi20_song_cursor_seek(song, pc, track,
+		    umidi20_song_play_min(song, track, position_fine));
+		changed = 1;
+	}
+	if (changed == 0)
+		return;
+
+	song->play_heap_num = 0;
+
+	for (x = 0; x != song->play_cursor_num; x++) {
+		pc = song->play_cursor + x;
+		if (pc->event == NULL)
+			continue;
+		song->play_heap[song->play_heap_num] = pc;
+		song->play_heap_num++;
+		umidi20_song_heap_fix(song, song->play_heap_num - 1);
 	}
-	return song;
 }
 
-void
-umidi20_song_free(struct umidi20_song *song)
+/*
+ * Set the root position of the next event to play. Must be called
+ * having the root device and the song locked, and the cursors
+ * revalidated.
+ */
+static void
+umidi20_song_play_next(struct umidi20_song *song)
 {
-	struct umidi20_track *track;
+	struct umidi20_event *event;
 
-	if (song == NULL) {
+	if (song->play_heap_num == 0) {
+		song->play_next_valid = 0;
 		return;
 	}
-	pthread_mutex_assert(song->p_mtx, MA_OWNED);
+	event = song->play_heap[0]->event;
 
-	umidi20_stop_thread(&(song->thread_io), song->p_mtx);
+	if (event->position >= song->play_end_offset) {
+		song->play_next_valid = 0;
+		return;
+	}
+	song->play_next_pos = event->position +
+	    root_dev.play[event->device_no % UMIDI20_N_DEVICES].start_position;
+	song->play_next_frac = event->position_frac;
+	song->play_next_valid = 1;
+}
 
-	umidi20_song_stop(song, UMIDI20_FLAG_PLAY | UMIDI20_FLAG_RECORD);
+/*
+ * Create a cursor for every track of the song, positioned at the
+ * first event not yet played.
+ */
+static void
+umidi20_song_play_rebuild(struct umidi20_song *song)
+{
+	struct umidi20_song_cursor *pc;
+	struct umidi20_track *track;
+	uint32_t num = 0;
 
-	while (1) {
+	pthread_mutex_assert(song->p_mtx, MA_OWNED);
 
-		UMIDI20_IF_DEQUEUE(&(song->queue), track);
+	UMIDI20_QUEUE_FOREACH(track, &(song->queue))
+		num++;
+
+	if (num > song->play_heap_max) {
+		free(song->play_cursor);
+		free(song->play_heap);
+		song->play_cursor = malloc(sizeof(song->play_cursor[0]) * num);
+		song->play_heap = malloc(sizeof(song->play_heap[0]) * num);
+		if (song->play_cursor == NULL || song->play_heap == NULL) {
+			free(song->play_cursor);
+			free(song->play_heap);
+			song->play_cursor = NULL;
+			song->play_heap = NULL;
+			num = 0;
+		}
+		song->play_heap_max = num;
+	}
+	song->play_heap_num = 0;
+	song->play_cursor_num = 0;
 
-		if (track == NULL) {
+	pc = song->play_cursor;
+
+	UMIDI20_QUEUE_FOREACH(track, &(song->queue)) {
+		if (pc == song->play_cursor + song->play_heap_max)
 			break;
+		umidi20_song_cursor_seek(song, pc, track, 0);
+		if (pc->event != NULL) {
+			song->play_heap[song->play_heap_num] = pc;
+			umidi20_song_heap_fix(song, song->play_heap_num);
+			song->play_heap_num++;
 		}
-		umidi20_track_free(track);
+		song->play_cursor_num++;
+		pc++;
 	}
 
-	free(song);
+	pthread_mutex_lock(&root_dev.mutex);
+	umidi20_song_play_next(song);
+	pthread_mutex_unlock(&root_dev.mutex);
+
+	umidi20_wakeup();
 }
 
+/*
+ * Play all due events of a song using zero copy playback. Events for
+ * devices having a play callback are copied to the given queue, so
+ * that the callbacks can be called when no song is locked. Must be
+ * called having the root device locked.
+ */
 static void
-umidi20_watchdog_song_sub(struct umidi20_song *song)
+umidi20_watchdog_play_song(struct umidi20_song *song,
+    struct umidi20_event_queue *copy, uint64_t position_fine)
 {
-	struct umidi20_track *track;
+	struct umidi20_song_cursor *pc;
+	struct umidi20_device *dev;
 	struct umidi20_event *event;
-	struct umidi20_event_queue queue;
+	struct umidi20_track *track;
 	uint32_t curr_position;
-	uint32_t position;
-	uint32_t x;
-
-	pthread_mutex_assert(song->p_mtx, MA_OWNED);
-
-	memset(&queue, 0, sizeof(queue));
-
-	pthread_mutex_lock(&root_dev.mutex);
-	curr_position = root_dev.curr_position;
-	pthread_mutex_unlock(&root_dev.mutex);
+	uint8_t curr_frac;
 
-	track = song->queue.ifq_cache[UMIDI20_CACHE_INPUT];
+	curr_frac = position_fine;
 
-	if (song->rec_enabled && track) {
+	if (pthread_mutex_trylock(song->p_mtx) != 0) {
+		/* the song is being edited, try again soon */
+		song->play_next_pos = (position_fine >> UMIDI20_POSITION_FINE_SHIFT) + 1;
+		song->play_next_frac = curr_frac;
+		song->play_next_valid = 1;
+		return;
+	}
 
-		for (x = 0; x < UMIDI20_N_DEVICES; x++) {
+	umidi20_song_play_revalidate(song, position_fine);
 
-			while (1) {
+	while (song->play_heap_num != 0) {
 
-				event = umidi20_get_queue(x);
+		pc = song->play_heap[0];
+		track = pc->iter.track;
+		event = pc->event;
 
-				if (event == NULL) {
-					break;
-				}
-				umidi20_event_queue_insert
-				    (&(track->queue), event,
-				    UMIDI20_CACHE_INPUT);
-			}
+		if (event->position >= song->play_end_offset) {
+			song->play_enabled = 0;
+			break;
 		}
-	}
-	if (song->play_enabled) {
+		dev = &(root_dev.play[event->device_no % UMIDI20_N_DEVICES]);
 
-		position = (curr_position - song->play_start_position);
+		curr_position = (position_fine >> UMIDI20_POSITION_FINE_SHIFT) -
+		    dev->start_position;
 
-		position += (song->play_start_offset + 1500);
+		if (!umidi20_watchdog_event_due(event, curr_position, curr_frac))
+			break;
 
-		if (position >= song->play_end_offset) {
-			song->play_enabled = 0;
-			position = song->play_end_offset;
-		}
-		UMIDI20_QUEUE_FOREACH(track, &(song->queue)) {
-			if (!(track->mute_flag)) {
-				umidi20_event_queue_copy(&(track->queue), &queue,
-				    song->play_last_offset,
-				    position, 0, -1,
-				    UMIDI20_CACHE_OUTPUT, 0);
+		song->play_done_pos = event->position;
+		song->play_done_frac = event->position_frac;
+		song->play_done_valid = 1;
+
+		if (dev->enabled_usr && dev->enabled_cfg &&
+		    curr_position < dev->end_offset &&
+		    event->device_no < UMIDI20_N_DEVICES &&
+		    (track->mute_flag == 0 || umidi20_event_is_key_end(event))) {
+			if (dev->event_callback_func == NULL) {
+				umidi20_device_output(dev, event, position_fine,
+				    curr_position, curr_frac);
+			} else {
+				/* the song may change during the callback */
+				event = umidi20_event_copy(event, 0);
+				if (event != NULL)
+					UMIDI20_IF_ENQUEUE_LAST(copy, event);
 			}
 		}
 
-		song->play_last_offset = position;
-
-		while (1) {
-
-			UMIDI20_IF_DEQUEUE(&queue, event);
+		umidi20_song_cursor_set(pc, umidi20_track_iter_next(&pc->iter));
 
-			if (event == NULL) {
-				break;
-			}
-			umidi20_put_queue(event->device_no, event);
+		if (pc->event == NULL) {
+			song->play_heap[0] =
+			    song->play_heap[--(song->play_heap_num)];
 		}
+		umidi20_song_heap_fix(song, 0);
 	}
-}
 
+	umidi20_song_play_next(song);
 
-static void *
-umidi20_watchdog_song(void *arg)
+	pthread_mutex_unlock(song->p_mtx);
+}
+
+/*
+ * Output and free the events copied by zero copy playback. Must be
+ * called having the root device locked.
+ */
+static void
+umidi20_watchdog_play_copy(struct umidi20_event_queue *copy,
+    uint64_t position_fine)
 {
-	struct umidi20_song *song = arg;
+	struct umidi20_device *dev;
+	struct umidi20_event *event;
+	uint32_t curr_position;
 
-	pthread_mutex_lock(song->p_mtx);
+	while (1) {
+		UMIDI20_IF_DEQUEUE(copy, event);
 
-	while (song->thread_io != PTHREAD_NULL) {
+		if (event == NULL)
+			break;
 
-		umidi20_watchdog_song_sub(song);
+		dev = &(root_dev.play[event->device_no]);
 
-		pthread_mutex_unlock(song->p_mtx);
+		curr_position = (position_fine >> UMIDI20_POSITION_FINE_SHIFT) -
+		    dev->start_position;
 
-		usleep(250000);
+		umidi20_device_output(dev, event, position_fine,
+		    curr_position, position_fine);
 
-		pthread_mutex_lock(song->p_mtx);
+		umidi20_event_free(event);
 	}
+}
 
-	pthread_mutex_unlock(song->p_mtx);
+/*
+ * Enable or disable zero copy playback of the song, which takes
+ * effect the next time the song is started. While the song is
+ * playing the events of its tracks are passed by reference and must
+ * not be modified by the play callbacks. Devices having a play
+ * callback get a copy of each event instead, and the callback is
+ * called without the song locked.
+ *
+ * The events are only played while the song lock can be taken
+ * without waiting. While the application keeps the song locked, for
+ * example when editing or loading, playback of the song stalls and
+ * is retried every millisecond. Keep the song locked only briefly
+ * while it is playing.
+ */
+void
+umidi20_song_set_zero_copy(struct umidi20_song *song, uint8_t enable)
+{
+	if (song == NULL)
+		return;
 
-	return NULL;
+	pthread_mutex_assert(song->p_mtx, MA_OWNED);
+
+	song->play_zero_copy = (enable != 0);
 }
 
 struct umidi20_track *
@@ -2173,9 +4421,7 @@ umidi20_song_start(struct umidi20_song *song, uint32_t start_offset,
 	}
 	umidi20_start(start_offset, end_offset, flags);
 
-	pthread_mutex_lock(&root_dev.mutex);
-	curr_position = root_dev.curr_position;
-	pthread_mutex_unlock(&root_dev.mutex);
+	curr_position = umidi20_get_curr_position();
 
 	if (flags & UMIDI20_FLAG_PLAY) {
 		song->play_enabled = 1;
@@ -2187,12 +4433,23 @@ umidi20_song_start(struct umidi20_song *song, uint32_t start_offset,
 	if (flags & UMIDI20_FLAG_RECORD) {
 		song->rec_enabled = 1;
 	}
+	if ((flags & UMIDI20_FLAG_PLAY) && song->play_zero_copy) {
+		song->play_direct = 1;
+		song->play_done_valid = 0;
+		umidi20_song_play_rebuild(song);
+
+		pthread_mutex_lock(&root_dev.mutex);
+		TAILQ_INSERT_TAIL(&root_dev.songs, song, play_entry);
+		pthread_mutex_unlock(&root_dev.mutex);
+	}
 	/* update buffering */
 
 	umidi20_watchdog_song_sub(song);
 
 	song->pc_flags |= flags;
 
+	umidi20_song_wakeup(song);
+
 done:	;
 }
 
@@ -2211,6 +4468,14 @@ umidi20_song_stop(struct umidi20_song *song, uint8_t flags)
 
 	if (flags & UMIDI20_FLAG_PLAY) {
 		song->play_enabled = 0;
+
+		if (song->play_direct) {
+			song->play_direct = 0;
+
+			pthread_mutex_lock(&root_dev.mutex);
+			TAILQ_REMOVE(&root_dev.songs, song, play_entry);
+			pthread_mutex_unlock(&root_dev.mutex);
+		}
 	}
 	if (flags & UMIDI20_FLAG_RECORD) {
 		song->rec_enabled = 0;
@@ -2243,6 +4508,10 @@ umidi20_song_track_add(struct umidi20_song *song,
 			UMIDI20_IF_ENQUEUE_AFTER(&(song->queue), track_ref, track_new);
 		}
 	}
+	/* the conductor track may have changed */
+	song->tempo_map_num = 0;
+	if (song->play_direct)
+		umidi20_song_play_rebuild(song);
 }
 
 void
@@ -2259,150 +4528,471 @@ umidi20_song_track_remove(struct umidi20_song *song,
 	}
 	UMIDI20_IF_REMOVE(&(song->queue), track);
 
+	/* the conductor track may have changed */
+	song->tempo_map_num = 0;
+
+	if (song->play_direct)
+		umidi20_song_play_rebuild(song);
+
 	umidi20_track_free(track);
 }
 
-void
-umidi20_song_recompute_position(struct umidi20_song *song)
+/*
+ * Sort the given event and all events after it in the given track by
+ * tick, keeping the order of events having the same tick. Events are
+ * inserted by their previous position, which may be unset. The track
+ * statistics are not changed, and the position index and the zero
+ * copy cursors are left stale, so this must only be called while
+ * recomputing the positions, see umidi20_song_recompute_track().
+ */
+static void
+umidi20_track_sort_tick(struct umidi20_track *track,
+    struct umidi20_event *event)
 {
-	struct umidi20_track *conductor_track;
-	struct umidi20_track *track;
-	struct umidi20_event *event;
-	struct umidi20_event *event_copy;
+	struct umidi20_event_queue temp;
+	struct umidi20_event *event_n;
 
-	uint32_t tempo;
-	uint32_t last_tick;
-	uint32_t delta_tick;
-	uint32_t factor;
-	uint32_t position_curr;
-	uint32_t position_rem;
-	uint32_t divisor;
+	if (event == NULL || track->packed != NULL)
+		return;
 
-	if (song == NULL) {
+	for (event_n = event->p_prevpkt; event != NULL;
+	    event_n = event, event = event->p_nextpkt) {
+		if (event_n != NULL && event_n->tick > event->tick)
+			break;
+	}
+	if (event == NULL)
 		return;
+
+	memset(&temp, 0, sizeof(temp));
+
+	while (event != NULL) {
+		event_n = event->p_nextpkt;
+		UMIDI20_IF_REMOVE(&(track->queue), event);
+		UMIDI20_IF_ENQUEUE_LAST(&temp, event);
+		event = event_n;
+	}
+
+	while (1) {
+		UMIDI20_IF_DEQUEUE(&temp, event);
+
+		if (event == NULL)
+			break;
+
+		/* most events are still in order */
+		for (UMIDI20_IF_POLL_TAIL(&(track->queue), event_n);
+		    event_n != NULL && event_n->tick > event->tick;
+		    event_n = event_n->p_prevpkt)
+			;
+
+		if (event_n == NULL) {
+			UMIDI20_IF_ENQUEUE_FIRST(&(track->queue), event);
+		} else {
+			UMIDI20_IF_ENQUEUE_AFTER(&(track->queue), event_n, event);
+		}
 	}
+}
+
+/*
+ * Build the tempo map of the given song, if the resolution, the
+ * division or the tempo events changed since it was built.
+ *
+ * Returns:
+ *    0: Success
+ * Else: Out of memory
+ */
+static uint8_t
+umidi20_song_check_tempo_map(struct umidi20_song *song)
+{
+	struct umidi20_track *conductor_track;
+
+	UMIDI20_IF_POLL_HEAD(&(song->queue), conductor_track);
+
+	if (song->tempo_map_num != 0 && (conductor_track == NULL ||
+	    conductor_track->stats.tempo_dirty == 0))
+		return (0);
+
+	return (umidi20_song_update_tempo_map(song));
+}
+
+/*
+ * Build the tempo map of the given song from the tempo events in the
+ * conductor track. The tempo map is a sorted array of segments having
+ * a constant tempo. The tempo map must be rebuilt, by setting
+ * "tempo_map_num" to zero, when the resolution or division of the
+ * song changes.
+ *
+ * Returns:
+ *    0: Success
+ * Else: Out of memory
+ */
+uint8_t
+umidi20_song_update_tempo_map(struct umidi20_song *song)
+{
+	struct umidi20_track_iter iter;
+	struct umidi20_tempo_segment *seg;
+	struct umidi20_track *conductor_track;
+	struct umidi20_event *event;
+	uint32_t divisor;
+	uint32_t delta_tick;
+	uint32_t num;
+	uint32_t x;
+
 	pthread_mutex_assert(song->p_mtx, MA_OWNED);
 
+	switch (song->midi_division_type) {
+	case UMIDI20_FILE_DIVISION_TYPE_PPQ:
+		divisor = (120 * song->midi_resolution);
+		break;
+	case UMIDI20_FILE_DIVISION_TYPE_SMPTE24:
+		divisor = (24 * song->midi_resolution);
+		break;
+	case UMIDI20_FILE_DIVISION_TYPE_SMPTE25:
+		divisor = (25 * song->midi_resolution);
+		break;
+	case UMIDI20_FILE_DIVISION_TYPE_SMPTE30DROP:
+		divisor = (29.97 * song->midi_resolution);
+		break;
+	case UMIDI20_FILE_DIVISION_TYPE_SMPTE30:
+		divisor = (30 * song->midi_resolution);
+		break;
+	default:
+		divisor = 120;
+		break;
+	}
+
+	if (song->midi_division_type == UMIDI20_FILE_DIVISION_TYPE_PPQ) {
+		song->tempo_factor = UMIDI20_BPM;
+	} else {
+		song->tempo_factor = (UMIDI20_BPM / 60);
+	}
+
 	UMIDI20_IF_POLL_HEAD(&(song->queue), conductor_track);
 
-	if (conductor_track == NULL) {
-		goto done;
+	if (conductor_track != NULL)
+		conductor_track->stats.tempo_dirty = 0;
+
+	/* only PPQ files have tempo events */
+	if (song->midi_division_type != UMIDI20_FILE_DIVISION_TYPE_PPQ)
+		conductor_track = NULL;
+
+	num = 1;
+
+	if (conductor_track != NULL) {
+		UMIDI20_TRACK_FOREACH(event, &iter, conductor_track) {
+			if (umidi20_event_is_tempo(event))
+				num++;
+		}
+	}
+
+	if (num > song->tempo_map_max) {
+		seg = realloc(song->tempo_map, sizeof(*seg) * num);
+		if (seg == NULL)
+			return (1);
+		song->tempo_map = seg;
+		song->tempo_map_max = num;
+	}
+
+	seg = song->tempo_map;
+	seg[0].tick = 0;
+	seg[0].position = 0;
+	seg[0].divisor = divisor;
+
+	num = 1;
+
+	if (conductor_track != NULL) {
+		UMIDI20_TRACK_FOREACH(event, &iter, conductor_track) {
+			if (!umidi20_event_is_tempo(event))
+				continue;
+
+			/*
+			 * Tempo events may have been inserted out of
+			 * order, before their position was computed:
+			 */
+			for (x = num; x > 1 && seg[x - 1].tick > event->tick; x--)
+				seg[x] = seg[x - 1];
+
+			seg[x].tick = event->tick;
+			seg[x].divisor = umidi20_event_get_tempo(event) *
+			    song->midi_resolution;
+			num++;
+		}
 	}
-	/*
-	 * First copy the conductor track to
-	 * all the other tracks:
-	 */
 
-	UMIDI20_QUEUE_FOREACH(event, &(conductor_track->queue)) {
+	for (x = 1; x != num; x++) {
+		delta_tick = seg[x].tick - seg[x - 1].tick;
 
-		if (umidi20_event_is_tempo(event)) {
+		/* the sub-millisecond remainder is dropped */
+		seg[x].position = seg[x - 1].position +
+		    ((uint64_t)delta_tick * song->tempo_factor) /
+		    seg[x - 1].divisor;
+	}
+	song->tempo_map_num = num;
+	return (0);
+}
 
-			UMIDI20_QUEUE_FOREACH(track, &(song->queue)) {
+/*
+ * Returns the last tempo segment starting before the given tick.
+ */
+static const struct umidi20_tempo_segment *
+umidi20_song_tempo_by_tick(struct umidi20_song *song, uint32_t tick)
+{
+	uint32_t lo = 1;
+	uint32_t hi = song->tempo_map_num;
+	uint32_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (song->tempo_map[mid].tick < tick)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (&song->tempo_map[lo - 1]);
+}
+
+/*
+ * Returns the last tempo segment starting at or before the given
+ * position.
+ */
+static const struct umidi20_tempo_segment *
+umidi20_song_tempo_by_position(struct umidi20_song *song, uint32_t position)
+{
+	uint32_t lo = 1;
+	uint32_t hi = song->tempo_map_num;
+	uint32_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (song->tempo_map[mid].position <= position)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (&song->tempo_map[lo - 1]);
+}
 
-				if (track != conductor_track) {
+uint64_t
+umidi20_song_tick_to_position_fine(struct umidi20_song *song, uint32_t tick)
+{
+	const struct umidi20_tempo_segment *seg;
+	uint64_t delta;
 
-					event_copy = umidi20_event_copy(event, 0);
-					if (event_copy == NULL) {
-						goto fail;
-					}
-					umidi20_event_queue_insert(&(track->queue),
-					    event_copy,
-					    UMIDI20_CACHE_INPUT);
-				}
+	if (umidi20_song_check_tempo_map(song))
+		return (0);
+
+	seg = umidi20_song_tempo_by_tick(song, tick);
+
+	delta = (uint64_t)(tick - seg->tick) * song->tempo_factor;
+
+	return (((seg->position + delta / seg->divisor) <<
+	    UMIDI20_POSITION_FINE_SHIFT) |
+	    (((delta % seg->divisor) << UMIDI20_POSITION_FINE_SHIFT) /
+	    seg->divisor));
+}
+
+uint32_t
+umidi20_song_position_to_tick(struct umidi20_song *song, uint32_t position)
+{
+	return (umidi20_song_position_fine_to_tick(song,
+	    (uint64_t)position << UMIDI20_POSITION_FINE_SHIFT));
+}
+
+uint32_t
+umidi20_song_position_fine_to_tick(struct umidi20_song *song,
+    uint64_t position_fine)
+{
+	const struct umidi20_tempo_segment *seg;
+	uint32_t position = position_fine >> UMIDI20_POSITION_FINE_SHIFT;
+	uint8_t frac = position_fine;
+
+	if (umidi20_song_check_tempo_map(song))
+		return (0);
+
+	seg = umidi20_song_tempo_by_position(song, position);
+
+	return (seg->tick + ((uint64_t)(position - seg->position) *
+	    seg->divisor + (((uint64_t)frac * seg->divisor) >>
+	    UMIDI20_POSITION_FINE_SHIFT)) / song->tempo_factor);
+}
+
+/*
+ * Recompute the position of all events in the given track, starting
+ * at the given position.
+ */
+static void
+umidi20_song_recompute_track(struct umidi20_song *song,
+    struct umidi20_track *track, uint32_t position)
+{
+	struct umidi20_track_iter iter;
+	struct umidi20_packed_event *p;
+	struct umidi20_event *event;
+	struct umidi20_event *event_prev;
+	uint64_t fine;
+	uint32_t x;
+
+	event = umidi20_track_iter_seek(&iter, track, position);
+
+	if (track->packed != NULL) {
+		for (x = iter.index; x != track->packed_num; x++) {
+			p = &track->packed[x];
+
+			fine = umidi20_song_tick_to_position_fine(song, p->tick);
+
+			p->position = fine >> UMIDI20_POSITION_FINE_SHIFT;
+			p->position_frac = fine;
+
+			if (p->cmd[0] == 0) {
+				event = track->packed_ext[p->cmd[1] |
+				    (p->cmd[2] << 8) | (p->cmd[3] << 16)];
+				umidi20_event_set_position_fine(event, fine);
 			}
 		}
+	} else if (event != NULL) {
+		event_prev = event->p_prevpkt;
+
+		umidi20_track_sort_tick(track, event);
+
+		if (event_prev != NULL)
+			event = event_prev->p_nextpkt;
+		else
+			UMIDI20_IF_POLL_HEAD(&(track->queue), event);
+
+		for (; event != NULL; event = event->p_nextpkt) {
+			umidi20_event_set_position_fine(event,
+			    umidi20_song_tick_to_position_fine(song, event->tick));
+		}
+		umidi20_event_index_rebuild(&(track->queue));
+	}
+	track->stats.dirty_tick = UMIDI20_DIRTY_NONE;
+	track->stats.dirty_position = UMIDI20_DIRTY_NONE;
+
+	/* zero copy playback must seek again */
+	track->stats.changes++;
+
+	/* the note durations have changed */
+	umidi20_track_invalidate_max_min(track);
+}
+
+void
+umidi20_song_recompute_position(struct umidi20_song *song)
+{
+	struct umidi20_track *track;
+
+	if (song == NULL) {
+		return;
 	}
+	pthread_mutex_assert(song->p_mtx, MA_OWNED);
+
+	if (umidi20_song_update_tempo_map(song))
+		return;
+
+	song->dirty_tick = UMIDI20_DIRTY_NONE;
 
 	/*
 	 * Compute new position information:
 	 */
-	UMIDI20_QUEUE_FOREACH(track, &(song->queue)) {
-
-		tempo = 120;		/* BPM */
-		last_tick = 0;
-		position_curr = 0;
-		position_rem = 0;
-
-		switch (song->midi_division_type) {
-		case UMIDI20_FILE_DIVISION_TYPE_PPQ:
-			divisor = (tempo * song->midi_resolution);
-			break;
-		case UMIDI20_FILE_DIVISION_TYPE_SMPTE24:
-			divisor = (24 * song->midi_resolution);
-			break;
-		case UMIDI20_FILE_DIVISION_TYPE_SMPTE25:
-			divisor = (25 * song->midi_resolution);
-			break;
-		case UMIDI20_FILE_DIVISION_TYPE_SMPTE30DROP:
-			divisor = (29.97 * song->midi_resolution);
-			break;
-		case UMIDI20_FILE_DIVISION_TYPE_SMPTE30:
-			divisor = (30 * song->midi_resolution);
-			break;
-		default:
-			divisor = 120;
-			break;
-		}
-
-		if (song->midi_division_type == UMIDI20_FILE_DIVISION_TYPE_PPQ) {
-			factor = UMIDI20_BPM;
-		} else {
-			factor = (UMIDI20_BPM / 60);
-		}
-
-		DPRINTF("divisor=%d\n", divisor);
+	UMIDI20_QUEUE_FOREACH(track, &(song->queue))
+		umidi20_song_recompute_track(song, track, 0);
+}
 
-		UMIDI20_QUEUE_FOREACH(event, &(track->queue)) {
+/*
+ * Mark the events at or after the given tick in the given track as
+ * needing new positions. If the track is the conductor track, the
+ * tempo may have changed and all tracks are affected. Inserting and
+ * removing events marks the track automatically, so this is only
+ * needed after changing the tick of events in place.
+ */
+void
+umidi20_song_set_dirty(struct umidi20_song *song,
+    struct umidi20_track *track, uint32_t tick)
+{
+	if (song == NULL || track == NULL)
+		return;
 
-			delta_tick = (event->tick - last_tick);
-			last_tick = event->tick;
+	pthread_mutex_assert(song->p_mtx, MA_OWNED);
 
-			position_curr += (delta_tick / divisor) * factor;
-			position_rem += (delta_tick % divisor) * factor;
+	if (track == song->queue.ifq_head) {
+		if (song->dirty_tick > tick)
+			song->dirty_tick = tick;
+		song->tempo_map_num = 0;
+	} else {
+		if (track->stats.dirty_tick > tick)
+			track->stats.dirty_tick = tick;
+	}
+}
 
-			position_curr += (position_rem / divisor);
-			position_rem %= divisor;
+/*
+ * Recompute the positions of the events inserted or removed since
+ * the last time the positions were computed, and of the events
+ * marked by umidi20_song_set_dirty(), only. Any change to the
+ * conductor track makes all tracks dirty from its tick. An event
+ * changed in place must be marked using the lower of its old and new
+ * tick. Newly allocated tracks are dirty from tick zero.
+ */
+void
+umidi20_song_recompute_position_dirty(struct umidi20_song *song)
+{
+	struct umidi20_track *track;
+	uint32_t song_tick;
+	uint32_t position;
+	uint32_t tick;
 
-			DPRINTF("%d / %d, pos = %d, tick = %d\n", delta_tick,
-			    divisor, position_curr, event->tick);
+	if (song == NULL) {
+		return;
+	}
+	pthread_mutex_assert(song->p_mtx, MA_OWNED);
 
-			/* update position */
-			event->position = position_curr;
+	song_tick = song->dirty_tick;
 
-			if (umidi20_event_is_tempo(event) &&
-			    (song->midi_division_type == UMIDI20_FILE_DIVISION_TYPE_PPQ)) {
-				tempo = umidi20_event_get_tempo(event);
-				divisor = (tempo * song->midi_resolution);
-				position_rem = 0;
-			}
-		}
-	}
+	track = song->queue.ifq_head;
+	if (track != NULL && song_tick > track->stats.dirty_tick)
+		song_tick = track->stats.dirty_tick;
 
-fail:
 	/*
-	 * Remove all tempo information from
-	 * non-conductor tracks:
+	 * A tempo change at a given tick does not move any tick
+	 * before it, so the position of the dirty tick is the same
+	 * in the old and the new tempo map:
 	 */
-	UMIDI20_QUEUE_FOREACH(track, &(song->queue)) {
-
-		if (track != conductor_track) {
+	if (song_tick != UMIDI20_DIRTY_NONE) {
+		if (umidi20_song_update_tempo_map(song))
+			return;
+	} else if (umidi20_song_check_tempo_map(song)) {
+		return;
+	}
 
-			UMIDI20_QUEUE_FOREACH_SAFE(event, &(track->queue), event_copy) {
+	UMIDI20_QUEUE_FOREACH(track, &(song->queue)) {
+		tick = track->stats.dirty_tick;
+		if (tick > song_tick)
+			tick = song_tick;
+		if (tick == UMIDI20_DIRTY_NONE)
+			continue;
 
-				if (umidi20_event_is_tempo(event)) {
+		position = umidi20_song_tick_to_position_fine(song, tick) >>
+		    UMIDI20_POSITION_FINE_SHIFT;
 
-					UMIDI20_IF_REMOVE(&(track->queue), event);
+		/* inserted events are not sorted by tick */
+		if (position > track->stats.dirty_position)
+			position = track->stats.dirty_position;
 
-					umidi20_event_free(event);
-				}
-			}
-		}
+		umidi20_song_recompute_track(song, track, position);
 	}
-done:	;
+	song->dirty_tick = UMIDI20_DIRTY_NONE;
 }
 
 void
 umidi20_song_recompute_tick(struct umidi20_song *song)
+{
+	umidi20_song_recompute_tick_shift(song, 0);
+}
+
+/*
+ * Same like umidi20_song_recompute_tick(), except that the given
+ * number of sub-millisecond bits, zero or UMIDI20_FINE_TICK_SHIFT, is
+ * added to the ticks. The caller must check that the ticks don't
+ * overflow.
+ */
+void
+umidi20_song_recompute_tick_shift(struct umidi20_song *song, uint8_t shift)
 {
 	struct umidi20_track *track;
 	struct umidi20_event *event;
@@ -2413,8 +5003,13 @@ umidi20_song_recompute_tick(struct umidi20_song *song)
 	}
 	pthread_mutex_assert(song->p_mtx, MA_OWNED);
 
+	/* the tick values are updated in place */
+	UMIDI20_QUEUE_FOREACH(track, &(song->queue))
+		umidi20_track_unpack(track);
+
 	song->midi_division_type = UMIDI20_FILE_DIVISION_TYPE_PPQ;
-	song->midi_resolution = 500;
+	song->midi_resolution = 500 << shift;
+	song->tempo_map_num = 0;
 
 	/*
 	 * First remove all tempo
@@ -2424,10 +5019,12 @@ umidi20_song_recompute_tick(struct umidi20_song *song)
 
 		UMIDI20_QUEUE_FOREACH_SAFE(event, &(track->queue), event_next) {
 
-			event->tick = event->position;
+			event->tick = (event->position << shift) |
+			    (event->position_frac >>
+			    (UMIDI20_POSITION_FINE_SHIFT - shift));
 
 			if (umidi20_event_is_tempo(event)) {
-				UMIDI20_IF_REMOVE(&(track->queue), event);
+				umidi20_event_queue_remove(&(track->queue), event);
 				umidi20_event_free(event);
 			}
 		}
@@ -2507,8 +5104,10 @@ umidi20_config_import(struct umidi20_config *cfg)
 		    cfg->cfg_dev[x].rec_enabled_cfg) {
 
 			root_dev.rec[x].update = 1;
+			pthread_mutex_lock(&root_dev.rec[x].mtx);
 			root_dev.rec[x].enabled_cfg =
 			    cfg->cfg_dev[x].rec_enabled_cfg;
+			pthread_mutex_unlock(&root_dev.rec[x].mtx);
 		}
 		if (strcmp(root_dev.play[x].fname,
 		    cfg->cfg_dev[x].play_fname)) {
@@ -2522,8 +5121,10 @@ umidi20_config_import(struct umidi20_config *cfg)
 		    cfg->cfg_dev[x].play_enabled_cfg) {
 
 			root_dev.play[x].update = 1;
+			pthread_mutex_lock(&root_dev.play[x].mtx);
 			root_dev.play[x].enabled_cfg =
 			    cfg->cfg_dev[x].play_enabled_cfg;
+			pthread_mutex_unlock(&root_dev.play[x].mtx);
 		}
 	}
 	pthread_mutex_unlock(&root_dev.mutex);
@@ -2535,25 +5136,262 @@ umidi20_track_alloc(void)
 	struct umidi20_track *track;
 
 	track = malloc(sizeof(*track));
-	if (track)
+	if (track) {
 		memset(track, 0, sizeof(*track));
+		track->queue.ifq_stats = &track->stats;
+		track->stats.dirty_lo = UMIDI20_DIRTY_NONE;
+	}
 	return (track);
 }
 
 void
 umidi20_track_free(struct umidi20_track *track)
 {
+	uint32_t x;
+
 	if (track == NULL)
 		return;
 
 	umidi20_event_queue_drain(&(track->queue));
+	umidi20_event_queue_set_indexed(&(track->queue), 0);
 
+	if (track->packed != NULL) {
+		for (x = 0; x != track->packed_ext_num; x++)
+			umidi20_event_free(track->packed_ext[x]);
+		free(track->packed_ext);
+		free(track->packed);
+	}
 	free(track);
 }
 
-void
-umidi20_track_compute_max_min(struct umidi20_track *track)
+/*
+ * Returns non-zero if the given event fits into a packed event.
+ */
+static uint8_t
+umidi20_event_is_packable(struct umidi20_event *event)
+{
+	return (event->p_next == NULL && event->cmd[0] != 0 &&
+	    umidi20_command_to_len[event->cmd[0] & 0xF] <= 3);
+}
+
+/*
+ * Move all events of a track into packed storage. Commands longer
+ * than three bytes are kept out of line. The track queue is empty
+ * while the track is packed and the track must be unpacked before
+ * it is edited.
+ *
+ * The freed events are kept for reuse and are not given back to the
+ * heap. Packing the tracks of a loaded song therefore only reduces
+ * the memory used when done while loading, using
+ * UMIDI20_LOAD_FLAG_PACK, so that the events of one track are reused
+ * by the next one.
+ *
+ * Returns:
+ *    0: Success
+ * Else: Out of memory
+ */
+uint8_t
+umidi20_track_pack(struct umidi20_track *track)
+{
+	struct umidi20_packed_event *packed;
+	struct umidi20_packed_event *p;
+	struct umidi20_event **ext;
+	struct umidi20_event *event;
+	uint32_t num_ext = 0;
+	uint32_t num = 0;
+
+	if (track->packed != NULL)
+		return (0);
+
+	UMIDI20_QUEUE_FOREACH(event, &(track->queue)) {
+		if (!umidi20_event_is_packable(event))
+			num_ext++;
+	}
+	if (num_ext >= (1U << 24))
+		return (1);
+
+	packed = malloc(sizeof(packed[0]) * (UMIDI20_IF_QLEN(&(track->queue)) + 1));
+	ext = malloc(sizeof(ext[0]) * (num_ext + 1));
+	if (packed == NULL || ext == NULL) {
+		free(packed);
+		free(ext);
+		return (1);
+	}
+	num_ext = 0;
+
+	while (1) {
+		UMIDI20_IF_POLL_HEAD(&(track->queue), event);
+		if (event == NULL)
+			break;
+		umidi20_event_queue_remove(&(track->queue), event);
+
+		p = &packed[num++];
+		p->position = event->position;
+		p->tick = event->tick;
+		p->revision = event->revision;
+		p->position_frac = event->position_frac;
+		p->device_no = event->device_no;
+
+		if (umidi20_event_is_packable(event)) {
+			memcpy(p->cmd, event->cmd, sizeof(p->cmd));
+			umidi20_event_free(event);
+		} else {
+			p->cmd[0] = 0;
+			p->cmd[1] = num_ext & 0xFF;
+			p->cmd[2] = (num_ext >> 8) & 0xFF;
+			p->cmd[3] = (num_ext >> 16) & 0xFF;
+			ext[num_ext++] = event;
+		}
+	}
+
+	track->packed = packed;
+	track->packed_num = num;
+	track->packed_ext = ext;
+	track->packed_ext_num = num_ext;
+
+	umidi20_track_invalidate_max_min(track);
+	return (0);
+}
+
+/*
+ * Move all events of a packed track back into the track queue.
+ *
+ * Returns:
+ *    0: Success
+ * Else: Out of memory, the track is left packed
+ */
+uint8_t
+umidi20_track_unpack(struct umidi20_track *track)
+{
+	struct umidi20_packed_event *p;
+	struct umidi20_event *event;
+	struct umidi20_event *chain = NULL;
+	struct umidi20_event **pp_next = &chain;
+	uint32_t x;
+
+	if (track->packed == NULL)
+		return (0);
+
+	/* allocate all events first */
+	for (x = 0; x != track->packed_num; x++) {
+		if (track->packed[x].cmd[0] == 0)
+			continue;
+		if (umidi20_event_alloc(&pp_next, 0) == NULL) {
+			umidi20_event_free(chain);
+			return (1);
+		}
+	}
+
+	for (x = 0; x != track->packed_num; x++) {
+		p = &track->packed[x];
+
+		if (p->cmd[0] == 0) {
+			event = track->packed_ext[p->cmd[1] |
+			    (p->cmd[2] << 8) | (p->cmd[3] << 16)];
+		} else {
+			event = chain;
+			chain = event->p_next;
+			event->p_next = NULL;
+			memcpy(event->cmd, p->cmd, sizeof(p->cmd));
+			event->tick = p->tick;
+			event->revision = p->revision;
+			event->device_no = p->device_no;
+		}
+		event->position = p->position;
+		event->position_frac = p->position_frac;
+
+		umidi20_event_queue_insert(&(track->queue), event, UMIDI20_CACHE_EDIT);
+	}
+
+	free(track->packed_ext);
+	free(track->packed);
+
+	track->packed = NULL;
+	track->packed_num = 0;
+	track->packed_ext = NULL;
+	track->packed_ext_num = 0;
+
+	umidi20_track_invalidate_max_min(track);
+	return (0);
+}
+
+static struct umidi20_event *
+umidi20_track_iter_get(struct umidi20_track_iter *iter)
 {
+	struct umidi20_track *track = iter->track;
+	struct umidi20_packed_event *p;
+	struct umidi20_event *event = &iter->event;
+
+	if (iter->index >= track->packed_num)
+		return (NULL);
+
+	p = &track->packed[iter->index];
+
+	if (p->cmd[0] == 0) {
+		return (track->packed_ext[p->cmd[1] |
+		    (p->cmd[2] << 8) | (p->cmd[3] << 16)]);
+	}
+	memset(event, 0, sizeof(*event));
+	memcpy(event->cmd, p->cmd, sizeof(p->cmd));
+	event->position = p->position;
+	event->position_frac = p->position_frac;
+	event->tick = p->tick;
+	event->revision = p->revision;
+	event->device_no = p->device_no;
+	return (event);
+}
+
+/*
+ * Returns the first event of a packed or unpacked track having a
+ * position greater than or equal to the given position. Events
+ * returned for packed tracks are only valid until the next call and
+ * must not be modified.
+ */
+struct umidi20_event *
+umidi20_track_iter_seek(struct umidi20_track_iter *iter,
+    struct umidi20_track *track, uint32_t position)
+{
+	uint32_t lo;
+	uint32_t hi;
+	uint32_t mid;
+
+	iter->track = track;
+
+	if (track->packed == NULL) {
+		iter->curr = umidi20_event_queue_search(&(track->queue),
+		    position, UMIDI20_CACHE_OTHER);
+		return (iter->curr);
+	}
+
+	lo = 0;
+	hi = track->packed_num;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (track->packed[mid].position < position)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	iter->index = lo;
+	return (umidi20_track_iter_get(iter));
+}
+
+struct umidi20_event *
+umidi20_track_iter_next(struct umidi20_track_iter *iter)
+{
+	if (iter->track->packed == NULL) {
+		if (iter->curr != NULL)
+			iter->curr = iter->curr->p_nextpkt;
+		return (iter->curr);
+	}
+	iter->index++;
+	return (umidi20_track_iter_get(iter));
+}
+
+static void
+umidi20_track_compute_max_min_full(struct umidi20_track *track)
+{
+	struct umidi20_track_iter iter;
 	struct umidi20_event *event;
 	struct umidi20_event *event_last;
 	struct umidi20_event *last_key_press[128];
@@ -2565,12 +5403,15 @@ umidi20_track_compute_max_min(struct umidi20_track *track)
 
 	memset(&last_key_press, 0, sizeof(last_key_press));
 
+	/* events may have been modified in place, recount the keys */
+	memset(track->stats.key_count, 0, sizeof(track->stats.key_count));
+
 	track->key_max = 0x00;
 	track->key_min = 0xFF;
 
 	track->position_max = 0;
 
-	UMIDI20_QUEUE_FOREACH(event, &(track->queue)) {
+	UMIDI20_TRACK_FOREACH(event, &iter, track) {
 
 		what = umidi20_event_get_what(event);
 
@@ -2580,7 +5421,12 @@ umidi20_track_compute_max_min(struct umidi20_track *track)
 			is_off = umidi20_event_is_key_end(event);
 			key = umidi20_event_get_key(event) & 0x7F;
 
-			if (is_on || is_off) {
+			/* only events in the queue are counted */
+			if (track->packed == NULL)
+				track->stats.key_count[key]++;
+
+			/* events of packed tracks have no duration */
+			if ((is_on || is_off) && track->packed == NULL) {
 
 				event_last = last_key_press[key];
 				last_key_press[key] = NULL;
@@ -2623,6 +5469,62 @@ umidi20_track_compute_max_min(struct umidi20_track *track)
 				track->instrument[what] = 0;
 			}
 		}
+		track->position_max = event->position;
+	}
+	if ((track->key_max == 0x00) &&
+	    (track->key_min == 0xFF)) {
+		track->key_max = 0x3C;
+		track->key_min = 0x3C;
+	}
+	track->band_min =
+	    UMIDI20_KEY_TO_BAND_NUMBER(track->key_min);
+
+	track->band_max =
+	    UMIDI20_KEY_TO_BAND_NUMBER(track->key_max + UMIDI20_BAND_SIZE);
+
+	for (key = 0; key < 0x80; key++) {
+		event_last = last_key_press[key];
+		if (event_last) {
+			event_last->duration =
+			    (track->position_max - event_last->position);
+		}
+		track->stats.open_event[key] = event_last;
+	}
+}
+
+#define	UMIDI20_STATS_LOOKAHEAD 256	/* events */
+
+/*
+ * Update the key range and the note durations of an unpacked track
+ * from the changes recorded in its statistics.
+ */
+static void
+umidi20_track_compute_max_min_changed(struct umidi20_track *track)
+{
+	struct umidi20_track_stats *stats = &track->stats;
+	struct umidi20_event *event;
+	struct umidi20_event *event_first;
+	struct umidi20_event *event_last;
+	struct umidi20_event *last_key_press[128];
+	uint32_t count[128];
+	uint8_t need[16];
+	uint32_t x;
+	uint8_t key;
+	uint8_t is_on;
+	uint8_t is_off;
+	uint8_t num = 0;
+
+	/* key range */
+	track->key_max = 0x00;
+	track->key_min = 0xFF;
+
+	for (key = 0; key < 0x80; key++) {
+		if (stats->key_count[key] == 0)
+			continue;
+		if (key > track->key_max)
+			track->key_max = key;
+		if (key < track->key_min)
+			track->key_min = key;
 	}
 	if ((track->key_max == 0x00) &&
 	    (track->key_min == 0xFF)) {
@@ -2636,14 +5538,164 @@ umidi20_track_compute_max_min(struct umidi20_track *track)
 	    UMIDI20_KEY_TO_BAND_NUMBER(track->key_max + UMIDI20_BAND_SIZE);
 
 	UMIDI20_IF_POLL_TAIL(&(track->queue), event);
-	if (event) {
-		track->position_max = event->position;
+	track->position_max = (event != NULL) ? event->position : 0;
+
+	/*
+	 * Find the pressed state of the changed keys before the
+	 * changed region:
+	 */
+	memset(last_key_press, 0, sizeof(last_key_press));
+	memcpy(need, stats->dirty_keys, sizeof(need));
+
+	for (key = 0; key < 0x80; key++) {
+		if (need[key / 8] & (1 << (key % 8)))
+			num++;
+	}
+
+	/* search from the end, when it is closer, like when appending */
+	event = track->queue.ifq_cache[UMIDI20_CACHE_OTHER];
+	if (event == NULL || (event->position < stats->dirty_lo &&
+	    stats->dirty_lo - event->position >
+	    track->position_max - stats->dirty_lo))
+		track->queue.ifq_cache[UMIDI20_CACHE_OTHER] = track->queue.ifq_tail;
+
+	event_first = umidi20_event_queue_search(&(track->queue),
+	    stats->dirty_lo, UMIDI20_CACHE_OTHER);
+
+	/*
+	 * Keys having all their events in or after the changed
+	 * region have no state before it. Only look a limited
+	 * distance past the changed region for this:
+	 */
+	memset(count, 0, sizeof(count));
+
+	for (event = event_first, x = 0; event != NULL;
+	    event = event->p_nextpkt) {
+		if (event->position > stats->dirty_hi &&
+		    ++x > UMIDI20_STATS_LOOKAHEAD)
+			break;
+		if (umidi20_event_get_what(event) & UMIDI20_WHAT_KEY)
+			count[umidi20_event_get_key(event) & 0x7F]++;
+	}
+	for (key = 0; key < 0x80 && event == NULL; key++) {
+		if ((need[key / 8] & (1 << (key % 8))) &&
+		    count[key] == stats->key_count[key]) {
+			need[key / 8] &= ~(1 << (key % 8));
+			num--;
+		}
+	}
+
+	if (event_first != NULL)
+		event = event_first->p_prevpkt;
+	else
+		UMIDI20_IF_POLL_TAIL(&(track->queue), event);
+
+	for (; event != NULL && num != 0; event = event->p_prevpkt) {
+		is_on = umidi20_event_is_key_start(event);
+		is_off = umidi20_event_is_key_end(event);
+		if (!is_on && !is_off)
+			continue;
+		key = umidi20_event_get_key(event) & 0x7F;
+		if (!(need[key / 8] & (1 << (key % 8))))
+			continue;
+		need[key / 8] &= ~(1 << (key % 8));
+		num--;
+		if (is_on)
+			last_key_press[key] = event;
 	}
+
+	/*
+	 * Update the durations of the changed keys, until all keys
+	 * pressed in the changed region have been released:
+	 */
+	num = 0;
 	for (key = 0; key < 0x80; key++) {
+		if (last_key_press[key] != NULL)
+			num++;
+	}
+
+	for (event = event_first; event != NULL; event = event->p_nextpkt) {
+		if (event->position > stats->dirty_hi && num == 0)
+			break;
+		is_on = umidi20_event_is_key_start(event);
+		is_off = umidi20_event_is_key_end(event);
+		if (!is_on && !is_off)
+			continue;
+		key = umidi20_event_get_key(event) & 0x7F;
+		if (!(stats->dirty_keys[key / 8] & (1 << (key % 8))))
+			continue;
+
 		event_last = last_key_press[key];
+		last_key_press[key] = NULL;
+
 		if (event_last) {
 			event_last->duration =
 			    (event->position - event_last->position);
+			if (event_last->position <= stats->dirty_hi)
+				num--;
+			if (stats->open_event[key] == event_last)
+				stats->open_event[key] = NULL;
+		}
+		if (is_on) {
+			last_key_press[key] = event;
+			if (event->position <= stats->dirty_hi)
+				num++;
+		}
+	}
+
+	/*
+	 * If the end of the track was reached, the changed keys still
+	 * pressed are pressed at the end. Else all events of the
+	 * changed keys pressed at the end are past the changed
+	 * region, and did not change:
+	 */
+	for (key = 0; key < 0x80 && event == NULL; key++) {
+		if (stats->dirty_keys[key / 8] & (1 << (key % 8)))
+			stats->open_event[key] = last_key_press[key];
+	}
+
+	/* keys pressed at the end last until the end of the track */
+	for (key = 0; key < 0x80; key++) {
+		event_last = stats->open_event[key];
+		if (event_last) {
+			event_last->duration =
+			    (track->position_max - event_last->position);
 		}
 	}
 }
+
+/*
+ * Compute the key range, position range and note durations of the
+ * given track. The result is cached until the track changes.
+ */
+void
+umidi20_track_compute_max_min(struct umidi20_track *track)
+{
+	struct umidi20_track_stats *stats = &track->stats;
+
+	if (stats->valid != 0 && stats->meta_dirty == 0 &&
+	    stats->dirty_lo == UMIDI20_DIRTY_NONE)
+		return;
+
+	if (stats->valid == 0 || stats->meta_dirty != 0 ||
+	    track->packed != NULL)
+		umidi20_track_compute_max_min_full(track);
+	else
+		umidi20_track_compute_max_min_changed(track);
+
+	stats->dirty_lo = UMIDI20_DIRTY_NONE;
+	stats->dirty_hi = 0;
+	memset(stats->dirty_keys, 0, sizeof(stats->dirty_keys));
+	stats->meta_dirty = 0;
+	stats->valid = 1;
+}
+
+/*
+ * Must be called after modifying events of the given track in place.
+ */
+void
+umidi20_track_invalidate_max_min(struct umidi20_track *track)
+{
+	track->stats.valid = 0;
+	track->stats.changes++;
+}
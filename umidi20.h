@@ -34,20 +34,54 @@
 #include <signal.h>
 #include <stdint.h>
 
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
+
 __BEGIN_DECLS
 
 #define	UMIDI20_BPM 60000		/* Beats Per Minute */
 
 #define	UMIDI20_COMMAND_LEN 8		/* bytes, max */
 #define	UMIDI20_BUF_EVENTS 1024		/* units */
+#define	UMIDI20_EVENT_PAGE 256		/* events per pool page */
+#define	UMIDI20_EVENT_CACHE 64		/* events per thread cache */
 
 #define	UMIDI20_N_DEVICES 16		/* units */
 
+#define	UMIDI20_WAKEUP_MAX 1000		/* milliseconds */
+#define	UMIDI20_LOOKAHEAD_DEF 1500	/* milliseconds, song playback */
+#define	UMIDI20_LOOKAHEAD_MIN 20	/* milliseconds, song playback */
+#define	UMIDI20_RECORD_POLL 250		/* milliseconds, song recording */
+#define	UMIDI20_TIMER_HASH 64		/* timer lookup buckets */
+#define	UMIDI20_RT_PREFAULT_MAX 65536	/* bytes of stack, max */
+#define	UMIDI20_RT_PREFAULT_CHUNK 4096	/* bytes of stack, per call */
+#define	UMIDI20_HIST_BUCKETS 64		/* 4 per power of two */
+
+#define	UMIDI20_POSITION_FINE_SHIFT 8	/* bits of sub-millisecond position */
+#define	UMIDI20_FINE_TICK_SHIFT 6	/* bits of sub-millisecond tick, when saving */
+
+#define	UMIDI20_RT_SCHED 0x01		/* realtime scheduling */
+#define	UMIDI20_RT_AFFINITY 0x02	/* CPU affinity */
+#define	UMIDI20_RT_STACK 0x04		/* stack size and prefault */
+#define	UMIDI20_RT_MLOCK 0x08		/* all memory locked */
+
 #define	UMIDI20_FLAG_PLAY 0x01
 #define	UMIDI20_FLAG_RECORD 0x02
 
+#define	UMIDI20_LOAD_FLAG_PACK 0x01	/* pack the tracks while loading */
+
+#define	UMIDI20_SAVE_FLAG_PRESERVE 0x01	/* do not modify the song, and
+					 * write the ticks of its tempo map */
+#define	UMIDI20_SAVE_FLAG_FINE 0x02	/* keep sub-millisecond positions,
+					 * unless preserving */
+
 #define	UMIDI20_MAX_OFFSET 0x80000000
 
+#define	UMIDI20_DIRTY_NONE 0xFFFFFFFFU	/* nothing changed */
+
 #define	UMIDI20_BAND_SIZE 24
 #define	UMIDI20_KEY_TO_BAND_OFFSET(n) (((n) + 12) % UMIDI20_BAND_SIZE)
 #define	UMIDI20_KEY_TO_BAND_NUMBER(n) (((n) + 12) / UMIDI20_BAND_SIZE)
@@ -91,6 +125,13 @@ struct umidi20_pipe;
 typedef void (umidi20_event_callback_t)(uint8_t unit, void *arg, struct umidi20_event *event, uint8_t *drop_event);
 typedef void (umidi20_timer_callback_t)(void *arg);
 
+struct umidi20_timer_stats {
+	uint64_t calls;			/* callbacks executed */
+	uint64_t overruns;		/* timeouts skipped */
+	uint32_t late_max;		/* worst lateness, in ms */
+	uint32_t busy_max;		/* longest callback, in us */
+};
+
 /*--------------------------------------------------------------------------*
  * queue structures and macros
  *--------------------------------------------------------------------------*/
@@ -101,10 +142,17 @@ typedef void (umidi20_timer_callback_t)(void *arg);
 #define	UMIDI20_CACHE_OTHER  3
 #define	UMIDI20_CACHE_MAX    4
 
+struct umidi20_event_index;
+
+struct umidi20_track_stats;
+
 struct umidi20_event_queue {
 	struct umidi20_event *ifq_head;
 	struct umidi20_event *ifq_tail;
 	struct umidi20_event *ifq_cache[UMIDI20_CACHE_MAX];
+	struct umidi20_event_index *ifq_index;	/* optional position index */
+	struct umidi20_track_stats *ifq_stats;	/* optional, updated on
+						 * insert and remove */
 
 	int32_t	ifq_len;
 	int32_t	ifq_maxlen;
@@ -217,7 +265,7 @@ struct umidi20_song_queue {
     if ((ifq)->ifq_tail == NULL) {		\
         (ifq)->ifq_tail = (m);			\
     } else {					\
-        (ifq)->ifq_head->p_prevkt = (m);	\
+        (ifq)->ifq_head->p_prevpkt = (m);	\
     }						\
     (ifq)->ifq_head = (m);			\
     (ifq)->ifq_len++;				\
@@ -275,10 +323,75 @@ struct umidi20_event {
 	uint32_t duration;		/* milliseconds */
 	uint16_t revision;		/* unit */
 	uint8_t	device_no;		/* device number */
-	uint8_t	unused;
+	uint8_t	position_frac;		/* 1/256 milliseconds */
 	uint8_t	cmd[UMIDI20_COMMAND_LEN];
 };
 
+/*--------------------------------------------------------------------------*
+ * Packed MIDI event structure, used by packed tracks
+ *--------------------------------------------------------------------------*/
+struct umidi20_packed_event {
+	uint32_t position;		/* milliseconds */
+	uint32_t tick;			/* units */
+	uint16_t revision;		/* unit */
+	uint8_t	position_frac;		/* 1/256 milliseconds */
+	uint8_t	device_no;		/* device number */
+	uint8_t	cmd[4];			/* short command, or zero followed
+					 * by the 24-bit index of an out of
+					 * line event */
+};
+
+struct umidi20_track;
+
+struct umidi20_track_iter {
+	struct umidi20_track *track;
+	struct umidi20_event *curr;
+	uint32_t index;
+	struct umidi20_event event;	/* unpacked short command */
+};
+
+#define	UMIDI20_TRACK_FOREACH(m, iter, track)			\
+  for ((m) = umidi20_track_iter_seek(iter, track, 0);		\
+       (m);							\
+       (m) = umidi20_track_iter_next(iter))
+
+/*--------------------------------------------------------------------------*
+ * Realtime thread configuration and status
+ *--------------------------------------------------------------------------*/
+/*
+ * Realtime settings for the play and record thread and for the
+ * backend workers. Must be set before umidi20_init() and before the
+ * backends are initialized. A zeroed structure disables all of them.
+ */
+struct umidi20_rt_config {
+	int	priority;		/* SCHED_FIFO priority, zero disables */
+	int	cpu;			/* CPU to run on plus one, zero means
+					 * any */
+	uint32_t stack_size;		/* bytes, zero means default */
+	uint8_t	mlock;			/* lock all memory, if set */
+};
+
+struct umidi20_rt_status {
+	uint32_t threads;		/* realtime threads created */
+	uint8_t	applied;		/* UMIDI20_RT_XXX, applied */
+	uint8_t	failed;			/* UMIDI20_RT_XXX, not permitted */
+};
+
+/*--------------------------------------------------------------------------*
+ * MIDI event pool statistics
+ *--------------------------------------------------------------------------*/
+struct umidi20_event_stats {
+	uint32_t pages;			/* pages allocated from the heap */
+	uint32_t total;			/* events */
+	uint32_t free;			/* events in the shared pool */
+	uint32_t cached;		/* events in per-thread caches */
+	uint32_t used;			/* events */
+	uint32_t used_max;		/* events outside the shared pool,
+					 * high water mark */
+	uint32_t failed;		/* allocation failures */
+	uint32_t threads;		/* per-thread caches */
+};
+
 /*--------------------------------------------------------------------------*
  * MIDI config structures
  *--------------------------------------------------------------------------*/
@@ -302,8 +415,28 @@ struct umidi20_config {
 /*--------------------------------------------------------------------------*
  * MIDI device structure
  *--------------------------------------------------------------------------*/
+/*
+ * Logarithmic histogram, with four buckets per power of two. Values
+ * above the range are counted in the last bucket. All fields are
+ * updated using atomic operations.
+ */
+struct umidi20_histogram {
+	uint64_t count[UMIDI20_HIST_BUCKETS];
+	uint64_t total;			/* sum of all values */
+	uint64_t max;			/* largest value */
+};
+
+struct umidi20_device_stats {
+	struct umidi20_histogram late;	/* us, output after scheduled time */
+	struct umidi20_histogram callback;	/* us, in play event callback */
+	struct umidi20_histogram depth;	/* events queued, when playing */
+	uint64_t drops;			/* events not written, pipe full */
+};
+
 struct umidi20_device {
 
+	pthread_mutex_t mtx;		/* protects the queue */
+	struct umidi20_device_stats stats;	/* play devices only */
 	struct umidi20_event_queue queue;
 	struct umidi20_converter conv;
 
@@ -327,22 +460,40 @@ struct umidi20_device {
 /*--------------------------------------------------------------------------*
  * MIDI root-device structure
  *--------------------------------------------------------------------------*/
+struct umidi20_wakeup {
+#ifdef __APPLE__
+	dispatch_semaphore_t sem;
+#else
+	sem_t	sem;
+#endif
+	uint8_t	pending;
+};
+
 struct umidi20_root_device {
 	struct umidi20_device rec[UMIDI20_N_DEVICES];
 	struct umidi20_device play[UMIDI20_N_DEVICES];
-	struct umidi20_event_queue free_queue;
 	struct timespec curr_time;
 	struct timespec start_time;
 	pthread_mutex_t mutex;
-	pthread_cond_t cond;
 
-	TAILQ_HEAD(, umidi20_timer_entry) timers;
+	struct umidi20_wakeup wakeup;
+
+	struct umidi20_wakeup timer_wakeup;
+
+	pthread_mutex_t timer_mtx;	/* protects the timers */
+	pthread_cond_t timer_cond;
+	struct umidi20_timer_entry **timer_heap;	/* by timeout */
+	uint32_t timer_num;
+	uint32_t timer_max;
+	LIST_HEAD(, umidi20_timer_entry) timer_hash[UMIDI20_TIMER_HASH];
+	TAILQ_HEAD(, umidi20_song) songs;	/* songs played without copying */
 
 	pthread_t thread_alloc;
 	pthread_t thread_play_rec;
+	pthread_t thread_timer;
 	pthread_t thread_files;
 
-	uint32_t curr_position;
+	uint32_t curr_position;		/* atomic */
 };
 
 extern struct umidi20_root_device root_dev;
@@ -350,8 +501,27 @@ extern struct umidi20_root_device root_dev;
 /*--------------------------------------------------------------------------*
  * MIDI track structure
  *--------------------------------------------------------------------------*/
+/*
+ * Changes to a track since umidi20_track_compute_max_min() was last
+ * called, which is then only redone for the changed keys.
+ */
+struct umidi20_track_stats {
+	uint32_t key_count[128];	/* key events, per key */
+	uint32_t dirty_lo;		/* first changed position */
+	uint32_t dirty_hi;		/* last changed position */
+	struct umidi20_event *open_event[128];	/* keys pressed at the end */
+	uint8_t	dirty_keys[16];		/* bitmap of changed keys */
+	uint32_t changes;		/* incremented on every change */
+	uint32_t dirty_tick;		/* first changed tick, see */
+	uint32_t dirty_position;	/* umidi20_song_set_dirty() */
+	uint8_t	meta_dirty;		/* name or instrument changed */
+	uint8_t	tempo_dirty;		/* tempo events changed */
+	uint8_t	valid;			/* key range and durations are valid */
+};
+
 struct umidi20_track {
 	struct umidi20_event_queue queue;
+	struct umidi20_track_stats stats;
 
 	struct umidi20_track *p_nextpkt;
 	struct umidi20_track *p_prevpkt;
@@ -371,11 +541,31 @@ struct umidi20_track {
 
 	uint8_t	name[256];
 	uint8_t	instrument[256];
+
+	/* packed storage, see umidi20_track_pack() */
+	struct umidi20_packed_event *packed;
+	struct umidi20_event **packed_ext;
+	uint32_t packed_num;
+	uint32_t packed_ext_num;
 };
 
 /*--------------------------------------------------------------------------*
  * MIDI song structure
  *--------------------------------------------------------------------------*/
+struct umidi20_tempo_segment {
+	uint32_t tick;			/* units, at start of segment */
+	uint32_t position;		/* milliseconds, at start of segment */
+	uint32_t divisor;		/* ticks per "tempo_factor" milliseconds */
+};
+
+struct umidi20_song_cursor {
+	struct umidi20_track_iter iter;
+	struct umidi20_event *event;	/* next event to play */
+	uint32_t changes;		/* track changes when last seeked */
+	uint32_t position;		/* of the next event, heap key */
+	uint8_t	position_frac;
+};
+
 struct umidi20_song {
 	struct umidi20_track_queue queue;
 	struct timespec play_start_time;
@@ -387,10 +577,29 @@ struct umidi20_song {
 	pthread_mutex_t *p_mtx;
 	pthread_t thread_io;
 
+	struct umidi20_wakeup wakeup;
+
+	/* zero copy playback, see umidi20_song_set_zero_copy() */
+	TAILQ_ENTRY(umidi20_song) play_entry;
+	struct umidi20_song_cursor *play_cursor;
+	struct umidi20_song_cursor **play_heap;
+	uint32_t play_heap_num;
+	uint32_t play_heap_max;
+	uint32_t play_cursor_num;	/* cursors in use, one per track */
+	uint32_t play_done_pos;		/* position of last event played */
+	uint32_t play_next_pos;		/* root position of next event */
+
+	struct umidi20_tempo_segment *tempo_map;
+	uint32_t tempo_map_num;
+	uint32_t tempo_map_max;
+	uint32_t tempo_factor;
+	uint32_t dirty_tick;		/* first tick of changed tempo */
+
 	uint32_t play_start_position;
 	uint32_t play_end_offset;
 	uint32_t play_start_offset;
 	uint32_t play_last_offset;
+	uint32_t play_lookahead;	/* milliseconds */
 	uint32_t position_max;
 	uint32_t track_max;
 	uint32_t band_max;
@@ -405,6 +614,13 @@ struct umidi20_song {
 	uint8_t	rec_enabled;
 
 	uint8_t	pc_flags;		/* play and record flags */
+
+	uint8_t	play_zero_copy;		/* play tracks without copying */
+	uint8_t	play_direct;		/* zero copy playback is active */
+	uint8_t	play_done_frac;
+	uint8_t	play_done_valid;
+	uint8_t	play_next_frac;
+	uint8_t	play_next_valid;	/* protected by the root device */
 };
 
 /*--------------------------------------------------------------------------*
@@ -412,16 +628,24 @@ struct umidi20_song {
  *--------------------------------------------------------------------------*/
 
 extern uint32_t umidi20_get_curr_position(void);
+extern uint64_t umidi20_get_curr_position_fine(void);
 extern void umidi20_set_record_event_callback(uint8_t device_no, umidi20_event_callback_t *func, void *arg);
 extern void umidi20_set_play_event_callback(uint8_t device_no, umidi20_event_callback_t *func, void *arg);
 extern void umidi20_init(void);
+extern void umidi20_set_rt_config(const struct umidi20_rt_config *cfg);
+extern void umidi20_get_rt_status(struct umidi20_rt_status *status);
+extern int umidi20_thread_create(pthread_t *ptd, void *(*fn)(void *), void *arg, uint8_t realtime);
+extern void umidi20_wakeup(void);
 extern void umidi20_uninit(void);
 extern struct umidi20_event *umidi20_event_alloc(struct umidi20_event ***ppp_next, uint8_t flag);
 extern void umidi20_event_free(struct umidi20_event *event);
+extern void umidi20_event_get_stats(struct umidi20_event_stats *stats);
 extern struct umidi20_event *umidi20_event_copy(struct umidi20_event *event, uint8_t flag);
 extern struct umidi20_event *umidi20_event_from_data(const uint8_t *data_ptr, uint32_t data_len, uint8_t flag);
 extern uint8_t *umidi20_event_pointer(struct umidi20_event *event, uint32_t offset);
 extern uint32_t umidi20_event_get_what(struct umidi20_event *event);
+extern uint64_t umidi20_event_get_position_fine(struct umidi20_event *event);
+extern void umidi20_event_set_position_fine(struct umidi20_event *event, uint64_t position);
 extern uint8_t umidi20_event_is_meta(struct umidi20_event *event);
 extern uint8_t umidi20_event_is_pitch_bend(struct umidi20_event *event);
 extern uint8_t umidi20_event_is_key_start(struct umidi20_event *event);
@@ -458,42 +682,73 @@ extern struct umidi20_event *umidi20_event_queue_search(struct umidi20_event_que
 extern void umidi20_event_queue_copy(struct umidi20_event_queue *src, struct umidi20_event_queue *dst, uint32_t pos_a, uint32_t pos_b, uint16_t rev_a, uint16_t rev_b, uint8_t cache_no, uint8_t flag);
 extern void umidi20_event_queue_move(struct umidi20_event_queue *src, struct umidi20_event_queue *dst, uint32_t pos_a, uint32_t pos_b, uint16_t rev_a, uint16_t rev_b, uint8_t cache_no);
 extern void umidi20_event_queue_insert(struct umidi20_event_queue *dst, struct umidi20_event *event_n, uint8_t cache_no);
+extern void umidi20_event_queue_merge(struct umidi20_event_queue *dst, struct umidi20_event_queue *src, uint8_t cache_no);
 extern void umidi20_event_queue_drain(struct umidi20_event_queue *src);
+extern uint8_t umidi20_event_queue_set_indexed(struct umidi20_event_queue *queue, uint8_t on);
+extern void umidi20_event_queue_remove(struct umidi20_event_queue *queue, struct umidi20_event *event);
 extern uint8_t umidi20_convert_to_command(struct umidi20_converter *conv, uint8_t b);
 struct umidi20_event *umidi20_convert_to_event(struct umidi20_converter *conv, uint8_t b, uint8_t flag);
 void	umidi20_convert_reset(struct umidi20_converter *conv);
 extern const uint8_t umidi20_command_to_len[16];
 extern void umidi20_gettime(struct timespec *ts);
 extern uint32_t umidi20_difftime(struct timespec *a, struct timespec *b);
+extern uint64_t umidi20_difftime_fine(struct timespec *a, struct timespec *b);
 extern int umidi20_mutex_init(pthread_mutex_t *pmutex);
 extern void umidi20_start(uint32_t start_position, uint32_t end_position, uint8_t flag);
 extern void umidi20_stop(uint8_t flag);
+extern void umidi20_put_queue_batch(uint8_t device_no, struct umidi20_event_queue *queue);
 struct umidi20_song *umidi20_song_alloc(pthread_mutex_t *p_mtx, uint16_t file_format, uint16_t resolution, uint8_t div_type);
 extern void umidi20_song_free(struct umidi20_song *song);
 extern struct umidi20_track *umidi20_song_track_by_unit(struct umidi20_song *song, uint16_t unit);
 extern void umidi20_song_set_record_track(struct umidi20_song *song, struct umidi20_track *track);
 extern void umidi20_song_start(struct umidi20_song *song, uint32_t start_offset, uint32_t end_offset, uint8_t flags);
 extern void umidi20_song_stop(struct umidi20_song *song, uint8_t flags);
+extern void umidi20_song_wakeup(struct umidi20_song *song);
+extern void umidi20_song_set_lookahead(struct umidi20_song *song, uint32_t ms);
+extern void umidi20_song_set_mute(struct umidi20_song *song, struct umidi20_track *track, uint8_t mute);
+extern void umidi20_song_set_zero_copy(struct umidi20_song *song, uint8_t enable);
 extern uint8_t umidi20_all_dev_off(uint8_t flag);
 extern void umidi20_song_track_add(struct umidi20_song *song, struct umidi20_track *track_ref, struct umidi20_track *track_new, uint8_t is_before_ref);
 extern void umidi20_song_track_remove(struct umidi20_song *song, struct umidi20_track *track);
 extern void umidi20_song_recompute_position(struct umidi20_song *song);
+extern void umidi20_song_recompute_position_dirty(struct umidi20_song *song);
+extern void umidi20_song_set_dirty(struct umidi20_song *song, struct umidi20_track *track, uint32_t tick);
+extern uint8_t umidi20_song_update_tempo_map(struct umidi20_song *song);
+extern uint64_t umidi20_song_tick_to_position_fine(struct umidi20_song *song, uint32_t tick);
+extern uint32_t umidi20_song_position_to_tick(struct umidi20_song *song, uint32_t position);
+extern uint32_t umidi20_song_position_fine_to_tick(struct umidi20_song *song, uint64_t position_fine);
 extern void umidi20_song_recompute_tick(struct umidi20_song *song);
+extern void umidi20_song_recompute_tick_shift(struct umidi20_song *song, uint8_t shift);
 extern void umidi20_song_compute_max_min(struct umidi20_song *song);
 extern void umidi20_config_export(struct umidi20_config *cfg);
 extern void umidi20_config_import(struct umidi20_config *cfg);
 extern struct umidi20_track *umidi20_track_alloc(void);
 extern void umidi20_track_free(struct umidi20_track *track);
 extern void umidi20_track_compute_max_min(struct umidi20_track *track);
+extern void umidi20_track_invalidate_max_min(struct umidi20_track *track);
+extern uint8_t umidi20_track_pack(struct umidi20_track *track);
+extern uint8_t umidi20_track_unpack(struct umidi20_track *track);
+extern struct umidi20_event *umidi20_track_iter_seek(struct umidi20_track_iter *iter, struct umidi20_track *track, uint32_t position);
+extern struct umidi20_event *umidi20_track_iter_next(struct umidi20_track_iter *iter);
 extern void umidi20_set_timer(umidi20_timer_callback_t *fn, void *arg, uint32_t ms_interval);
 extern void umidi20_update_timer(umidi20_timer_callback_t *fn, void *arg, uint32_t ms_interval, uint8_t do_sync);
 extern void umidi20_unset_timer(umidi20_timer_callback_t *fn, void *arg);
+extern void umidi20_get_device_stats(uint8_t device_no, struct umidi20_device_stats *stats);
+extern void umidi20_reset_device_stats(uint8_t device_no);
+extern uint64_t umidi20_histogram_percentile(const struct umidi20_histogram *hist, uint32_t permille);
+extern void umidi20_set_stats_dump(int fd, uint32_t ms_interval);
+extern int umidi20_get_timer_stats(umidi20_timer_callback_t *fn, void *arg, struct umidi20_timer_stats *stats);
 
 /*--------------------------------------------------------------------------*
  * prototypes from "umidi20_file.c"
  *--------------------------------------------------------------------------*/
 extern struct umidi20_song *umidi20_load_file(pthread_mutex_t *p_mtx, const uint8_t *ptr, uint32_t len);
+extern struct umidi20_song *umidi20_load_file_flags(pthread_mutex_t *p_mtx, const uint8_t *ptr, uint32_t len, uint8_t flags);
+extern struct umidi20_song *umidi20_load_file_fd(pthread_mutex_t *p_mtx, int fd);
+extern struct umidi20_song *umidi20_load_file_fd_flags(pthread_mutex_t *p_mtx, int fd, uint8_t flags);
 extern uint8_t umidi20_save_file(struct umidi20_song *song, uint8_t **pptr, uint32_t *plen);
+extern uint8_t umidi20_save_file_flags(struct umidi20_song *song, uint8_t **pptr, uint32_t *plen, uint8_t flags);
+extern uint8_t umidi20_save_file_fd(struct umidi20_song *song, int fd, uint8_t flags);
 
 /*--------------------------------------------------------------------------*
  * prototypes from "umidi20_assert.c"
@@ -579,6 +834,8 @@ void	umidi20_pipe_alloc(struct umidi20_pipe **, umidi20_pipe_callback_t *);
 void	umidi20_pipe_free(struct umidi20_pipe **);
 ssize_t	umidi20_pipe_read_data(struct umidi20_pipe **, uint8_t *, size_t);
 ssize_t	umidi20_pipe_write_data(struct umidi20_pipe **, const uint8_t *, size_t);
+ssize_t	umidi20_pipe_read_data_ts(struct umidi20_pipe **, uint8_t *, uint64_t *, size_t);
+ssize_t	umidi20_pipe_write_data_ts(struct umidi20_pipe **, const uint8_t *, size_t, uint64_t);
 
 /*--------------------------------------------------------------------------*
  * MIDI generator code
@@ -739,13 +996,17 @@ struct mid_data {
 	struct umidi20_track *track;	/* track we are generating */
 	uint32_t position[16];		/* track position */
 	uint32_t priv[16];		/* client counters */
+	struct umidi20_event_queue cc_queue;	/* carbon copy, not yet played */
 	uint8_t	channel;		/* currently selected MIDI channel */
 	uint8_t	cc_enabled;		/* carbon copy enabled */
 	uint8_t	cc_device_no;		/* carbon copy device number */
+	uint8_t	cc_batch;		/* carbon copy queued until mid_flush() */
 };
 
 extern const char *mid_key_str[128];
 void	mid_set_device_no(struct mid_data *d, uint8_t device_no);
+void	mid_set_batch(struct mid_data *d, uint8_t enable);
+void	mid_flush(struct mid_data *d);
 void	mid_sort(uint8_t *pk, uint8_t nk);
 void	mid_trans(uint8_t *pk, uint8_t nk, int8_t nt);
 uint8_t	mid_add(uint8_t a, uint8_t b);
@@ -793,7 +793,7 @@ umidi20_alsa_rx_open(uint8_t n, const char *name)
 		return (NULL);
 
 	umidi20_alsa_lock();
-	umidi20_pipe_alloc(&puj->write_fd, NULL);
+	umidi20_pipe_alloc(&puj->write_fd, &umidi20_wakeup);
 	umidi20_alsa_unlock();
 
 	/* try to connect */
@@ -924,8 +924,8 @@ umidi20_alsa_init(const char *name)
 
 	umidi20_alsa_init_done = 1;
 
-	pthread_create(&td, NULL, &umidi20_alsa_rx_worker, NULL);
-	pthread_create(&td, NULL, &umidi20_alsa_tx_worker, NULL);
+	umidi20_thread_create(&td, &umidi20_alsa_rx_worker, NULL, 1);
+	umidi20_thread_create(&td, &umidi20_alsa_tx_worker, NULL, 1);
 
 	return (0);
 }
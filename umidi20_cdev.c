@@ -178,7 +178,7 @@ umidi20_cdev_rx_open(uint8_t n, const char *name)
 	fcntl(puj->rx_fd, F_SETFL, (int)O_NONBLOCK);
 
 	umidi20_cdev_lock();
-	umidi20_pipe_alloc(&puj->write_pipe, NULL);
+	umidi20_pipe_alloc(&puj->write_pipe, &umidi20_wakeup);
 	umidi20_cdev_unlock();
 
 	return (&puj->write_pipe);
@@ -361,8 +361,8 @@ umidi20_cdev_init(const char *name)
 
 	umidi20_cdev_init_done = 1;
 
-	pthread_create(&td, NULL, &umidi20_cdev_rx_worker, NULL);
-	pthread_create(&td, NULL, &umidi20_cdev_tx_worker, NULL);
+	umidi20_thread_create(&td, &umidi20_cdev_rx_worker, NULL, 1);
+	umidi20_thread_create(&td, &umidi20_cdev_tx_worker, NULL, 1);
 
 	return (0);
 }
@@ -544,7 +544,7 @@ umidi20_coremidi_rx_open(uint8_t n, const char *name)
 
 	/* create looback pipe */
 	umidi20_coremidi_lock();
-	umidi20_pipe_alloc(&puj->write_fd, NULL);
+	umidi20_pipe_alloc(&puj->write_fd, &umidi20_wakeup);
 	umidi20_coremidi_unlock();
 
 	return (&puj->write_fd);
@@ -24,10 +24,17 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "umidi20.h"
 
@@ -46,14 +53,103 @@ struct midi_file {
 	uint8_t *ptr;
 	uint32_t end;
 	uint32_t off;
+	int	fd;			/* output file descriptor or -1 */
+	uint8_t	grow;			/* output buffer is growable */
+	uint8_t	flags;			/* UMIDI20_SAVE_FLAG_XXX */
+	uint8_t	error;			/* out of memory or write error */
 };
 
+/*
+ * Make room for at least "len" more bytes in a growable output
+ * buffer.
+ *
+ * Returns:
+ *    0: Success
+ * Else: Buffer is not growable or out of memory
+ */
+static uint8_t
+midi_grow(struct midi_file *pmf, uint32_t len)
+{
+	uint8_t *ptr;
+	uint32_t end;
+
+	if (pmf->grow == 0 || pmf->error != 0)
+		return (1);
+
+	end = pmf->end;
+	if (end == 0)
+		end = 4096;
+
+	while ((end - pmf->off) < len) {
+		if (end >= 0x80000000U)
+			goto error;
+		end *= 2;
+	}
+
+	ptr = realloc(pmf->ptr, end);
+	if (ptr == NULL)
+		goto error;
+
+	pmf->ptr = ptr;
+	pmf->end = end;
+	return (0);
+
+error:
+	pmf->error = 1;
+	return (1);
+}
+
+/*
+ * Write the "len" bytes at "hdr" followed by the buffered data to
+ * the output file descriptor and empty the buffer.
+ *
+ * Returns:
+ *    0: Success
+ * Else: Write error
+ */
+static uint8_t
+midi_flush(struct midi_file *pmf, uint8_t *hdr, uint32_t len)
+{
+	struct iovec iov[2];
+	ssize_t err;
+	int n = 0;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = len;
+	iov[1].iov_base = pmf->ptr;
+	iov[1].iov_len = pmf->off;
+
+	while (n != 2) {
+		if (iov[n].iov_len == 0) {
+			n++;
+			continue;
+		}
+		err = writev(pmf->fd, iov + n, 2 - n);
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+			pmf->error = 1;
+			return (1);
+		}
+		for (; n != 2 && (size_t)err >= iov[n].iov_len; n++)
+			err -= iov[n].iov_len;
+		if (n != 2) {
+			iov[n].iov_base = (uint8_t *)iov[n].iov_base + err;
+			iov[n].iov_len -= err;
+		}
+	}
+	pmf->off = 0;
+	return (0);
+}
+
 static void
 midi_write_multi(struct midi_file *pmf, const void *ptr, uint32_t len)
 {
 	uint32_t rem;
 
 	rem = pmf->end - pmf->off;
+	if (len > rem && midi_grow(pmf, len) == 0)
+		rem = pmf->end - pmf->off;
 	if (len > rem)
 		len = rem;
 
@@ -66,7 +162,7 @@ midi_write_multi(struct midi_file *pmf, const void *ptr, uint32_t len)
 static void
 midi_write_1(struct midi_file *pmf, uint8_t val)
 {
-	if (pmf->end == pmf->off)
+	if (pmf->end == pmf->off && midi_grow(pmf, 1))
 		return;
 
 	if (pmf->ptr != NULL)
@@ -257,32 +353,21 @@ write_event(struct umidi20_event *event, struct midi_file *out,
 	}
 }
 
-struct umidi20_song *
-umidi20_load_file(pthread_mutex_t *p_mtx, const uint8_t *ptr, uint32_t len)
+/*
+ * Parse the file header, up to the first chunk after "MThd".
+ */
+static struct umidi20_song *
+umidi20_load_header(pthread_mutex_t *p_mtx, struct midi_file *in,
+    uint16_t *pnum_tracks)
 {
-	struct midi_file in[1];
-	struct umidi20_song *song = NULL;
-	struct umidi20_track *track = NULL;
-	struct umidi20_event *event = NULL;
 	uint32_t chunk_size;
 	uint32_t chunk_start;
-	uint16_t number_of_tracks;
-	uint16_t number_of_tracks_read = 0;
 	uint16_t file_format;
 	uint16_t resolution;
 	uint8_t chunk_id[4];
 	uint8_t division_type_and_resolution[4];
 	uint8_t div_type;
-	uint8_t temp[4];
-	uint8_t flag = 0;
-
-	if (ptr == NULL || len == 0)
-		goto error;
-
-	/* init input file */
-	in[0].ptr = (uint8_t *)(long)ptr;
-	in[0].end = len;
-	in[0].off = 0;
+	struct umidi20_song *song;
 
 	midi_read_multi(in, chunk_id, 4);
 	chunk_size = read_uint32(in);
@@ -298,14 +383,14 @@ umidi20_load_file(pthread_mutex_t *p_mtx, const uint8_t *ptr, uint32_t len)
 		midi_read_multi(in, chunk_id, 4);
 
 		if (memcmp(chunk_id, "RMID", 4) != 0)
-			goto error;
+			return (NULL);
 
 		midi_read_multi(in, chunk_id, 4);
 
 		chunk_size = read_uint32(in);
 
 		if (memcmp(chunk_id, "data", 4) != 0)
-			goto error;
+			return (NULL);
 
 		midi_read_multi(in, chunk_id, 4);
 
@@ -313,11 +398,11 @@ umidi20_load_file(pthread_mutex_t *p_mtx, const uint8_t *ptr, uint32_t len)
 		chunk_start = midi_offset(in);
 	}
 	if (memcmp(chunk_id, "MThd", 4) != 0)
-		goto error;
+		return (NULL);
 
 	file_format = read_uint16(in);
 
-	number_of_tracks = read_uint16(in);
+	*pnum_tracks = read_uint16(in);
 
 	midi_read_multi(in, division_type_and_resolution, 2);
 
@@ -346,173 +431,316 @@ umidi20_load_file(pthread_mutex_t *p_mtx, const uint8_t *ptr, uint32_t len)
 
 	song = umidi20_song_alloc(p_mtx, file_format, resolution, div_type);
 
-	if (song == NULL)
-		goto error;
-
 	/* forwards compatibility:  skip over any extra header data */
 	midi_seek_set(in, chunk_start + chunk_size);
 
-	while (number_of_tracks_read < number_of_tracks) {
+	return (song);
+}
 
-		midi_read_multi(in, chunk_id, 4);
+/*
+ * Parse the contents of one "MTrk" chunk. Tempo information is only
+ * kept for the first track.
+ */
+static struct umidi20_track *
+umidi20_load_track(struct midi_file *in, uint32_t chunk_end, uint16_t track_no)
+{
+	struct umidi20_track *track;
+	struct umidi20_event *event = NULL;
+	uint8_t *data_ptr;
+	uint32_t data_len;
+	uint32_t tick = 0;
+	uint8_t status;
+	uint8_t running_status = 0;
+	uint8_t at_end_of_track = 0;
+	uint8_t temp[4];
+	uint8_t flag = 0;
 
-		chunk_size = read_uint32(in);
+	track = umidi20_track_alloc();
 
-		chunk_start = midi_offset(in);
+	if (track == NULL)
+		goto error;
 
-		if (memcmp(chunk_id, "MTrk", 4) == 0) {
+	while ((midi_offset(in) < chunk_end) &&
+	    (!at_end_of_track)) {
 
-			uint8_t *data_ptr;
-			uint32_t data_len;
-			uint32_t tick = 0;
-			uint8_t status;
-			uint8_t running_status = 0;
-			uint8_t at_end_of_track = 0;
+		tick += read_variable_length_quantity(in);
 
-			track = umidi20_track_alloc();
+		status = midi_read_peek_1(in);
 
-			if (track == NULL)
-				goto error;
+		if (status & 0x80)
+			running_status = midi_read_1(in);
+		else
+			status = running_status;
 
-			while ((midi_offset(in) <
-			    (chunk_start + chunk_size)) &&
-			    (!at_end_of_track)) {
+		DPRINTF("tick %u, status 0x%02x\n", tick, status);
 
-				tick += read_variable_length_quantity(in);
+		temp[0] = status;
 
-				status = midi_read_peek_1(in);
+		switch (status >> 4) {
+		case 0x8:	/* note off */
+		case 0x9:	/* note on */
+		case 0xA:	/* key pressure event */
+		case 0xB:	/* control change */
+		case 0xE:	/* pitch wheel event */
 
-				if (status & 0x80)
-					running_status = midi_read_1(in);
-				else
-					status = running_status;
+			temp[1] = midi_read_1(in) & 0x7F;
+			temp[2] = midi_read_1(in) & 0x7F;
 
-				DPRINTF("tick %u, status 0x%02x\n", tick, status);
+			event = umidi20_event_from_data(temp, 3, flag);
+			if (event == NULL)
+				goto error;
+			break;
+
+		case 0xC:	/* program change */
+		case 0xD:	/* channel pressure */
+			temp[1] = midi_read_1(in) & 0x7F;
 
-				temp[0] = status;
+			event = umidi20_event_from_data(temp, 2, flag);
+			if (event == NULL)
+				goto error;
+			break;
 
-				switch (status >> 4) {
-				case 0x8:	/* note off */
-				case 0x9:	/* note on */
-				case 0xA:	/* key pressure event */
-				case 0xB:	/* control change */
-				case 0xE:	/* pitch wheel event */
+		case 0xF:
+			switch (status) {
+			case 0xF1:	/* MIDI time code */
+			case 0xF3:	/* song select */
+				temp[1] = midi_read_1(in) & 0x7F;
 
-					temp[1] = midi_read_1(in) & 0x7F;
-					temp[2] = midi_read_1(in) & 0x7F;
+				event = umidi20_event_from_data(temp, 2, flag);
+				if (event == NULL)
+					goto error;
+				break;
+			case 0xF2:	/* song position pointer */
+				temp[1] = midi_read_1(in) & 0x7F;
+				temp[2] = midi_read_1(in) & 0x7F;
 
-					event = umidi20_event_from_data(temp, 3, flag);
+				event = umidi20_event_from_data(temp, 3, flag);
+				if (event == NULL)
+					goto error;
+				break;
+			case 0xF8:	/* beat */
+			case 0xFA:	/* song start */
+			case 0xFB:	/* song continue */
+			case 0xFC:	/* song stop */
+				event = umidi20_event_from_data(temp, 1, flag);
+				if (event == NULL)
+					goto error;
+				break;
+			case 0xF0:	/* System Exclusive
+					 * Begin */
+			case 0xF7:	/* System Exclusive End */
+				data_len = read_variable_length_quantity(in);
+				data_ptr = malloc(data_len + 2);
+
+				if (data_ptr == NULL)
+					goto error;
+
+				data_ptr[0] = 0xF0;
+				data_ptr[data_len + 1] = 0xF7;
+				midi_read_multi(in, data_ptr + 1, data_len);
+
+				event = umidi20_event_from_data(data_ptr, data_len + 2, flag);
+				free(data_ptr);
+				if (event == NULL)
+					goto error;
+				break;
+			case 0xFF:
+				temp[1] = midi_read_1(in) & 0x7F;
+				data_len = read_variable_length_quantity(in);
+				data_ptr = malloc(data_len + 2);
+
+				if (data_ptr == NULL)
+					goto error;
+
+				midi_read_multi(in, data_ptr + 2, data_len);
+
+				data_ptr[0] = 0xFF;
+				data_ptr[1] = temp[1];
+
+				if ((temp[1] == 0x51) &&
+				    (track_no != 0)) {
+
+					/*
+					 * discard tempo
+					 * information
+					 */
+					free(data_ptr);
+
+				} else if (temp[1] == 0x2F) {
+					/*
+					 * Set end tick
+					 */
+					at_end_of_track = 1;
+					free(data_ptr);
+				} else {
+					event = umidi20_event_from_data(data_ptr, data_len + 2, flag);
+					free(data_ptr);
 					if (event == NULL)
 						goto error;
-					break;
+				}
+				break;
+			default:
+				break;
+			}
+			break;
+		default:
+			break;
+		}
 
-				case 0xC:	/* program change */
-				case 0xD:	/* channel pressure */
-					temp[1] = midi_read_1(in) & 0x7F;
+		if (event) {
+			event->position = tick;
+			event->tick = tick;
+			umidi20_event_queue_insert(&(track->queue), event,
+			    UMIDI20_CACHE_INPUT);
+			event = NULL;
+		}
+	}
+	return (track);
 
-					event = umidi20_event_from_data(temp, 2, flag);
-					if (event == NULL)
-						goto error;
-					break;
+error:
+	umidi20_track_free(track);
+	return (NULL);
+}
 
-				case 0xF:
-					switch (status) {
-					case 0xF1:	/* MIDI time code */
-					case 0xF3:	/* song select */
-						temp[1] = midi_read_1(in) & 0x7F;
-
-						event = umidi20_event_from_data(temp, 2, flag);
-						if (event == NULL)
-							goto error;
-						break;
-					case 0xF2:	/* song position pointer */
-						temp[1] = midi_read_1(in) & 0x7F;
-						temp[2] = midi_read_1(in) & 0x7F;
-
-						event = umidi20_event_from_data(temp, 3, flag);
-						if (event == NULL)
-							goto error;
-						break;
-					case 0xF8:	/* beat */
-					case 0xFA:	/* song start */
-					case 0xFB:	/* song continue */
-					case 0xFC:	/* song stop */
-						event = umidi20_event_from_data(temp, 1, flag);
-						if (event == NULL)
-							goto error;
-						break;
-					case 0xF0:	/* System Exclusive
-							 * Begin */
-					case 0xF7:	/* System Exclusive End */
-						data_len = read_variable_length_quantity(in);
-						data_ptr = malloc(data_len + 2);
-
-						if (data_ptr == NULL)
-							goto error;
-
-						data_ptr[0] = 0xF0;
-						data_ptr[data_len + 1] = 0xF7;
-						midi_read_multi(in, data_ptr + 1, data_len);
-
-						event = umidi20_event_from_data(data_ptr, data_len + 2, flag);
-						free(data_ptr);
-						if (event == NULL)
-							goto error;
-						break;
-					case 0xFF:
-						temp[1] = midi_read_1(in) & 0x7F;
-						data_len = read_variable_length_quantity(in);
-						data_ptr = malloc(data_len + 2);
-
-						if (data_ptr == NULL)
-							goto error;
-
-						midi_read_multi(in, data_ptr + 2, data_len);
-
-						data_ptr[0] = 0xFF;
-						data_ptr[1] = temp[1];
-
-						if ((temp[1] == 0x51) &&
-						    (number_of_tracks_read != 0)) {
-
-							/*
-							 * discard tempo
-							 * information
-							 */
-							free(data_ptr);
-
-						} else if (temp[1] == 0x2F) {
-							/*
-							 * Set end tick
-							 */
-							at_end_of_track = 1;
-							free(data_ptr);
-						} else {
-							event = umidi20_event_from_data(data_ptr, data_len + 2, flag);
-							free(data_ptr);
-							if (event == NULL)
-								goto error;
-						}
-						break;
-					default:
-						break;
-					}
-					break;
-				default:
-					break;
-				}
+/*
+ * Tracks are parsed in parallel when the file is big enough to
+ * amortize the thread creation.
+ */
+#define	UMIDI20_LOAD_THREADS_MAX 16
+#define	UMIDI20_LOAD_PARALLEL_MIN 65536
 
-				if (event) {
-					event->position = tick;
-					event->tick = tick;
-					umidi20_event_queue_insert(&(track->queue), event,
-					    UMIDI20_CACHE_INPUT);
-					event = NULL;
-				}
-			}
-			number_of_tracks_read++;
-			umidi20_song_track_add(song, NULL, track, 0);
-			track = NULL;
+struct umidi20_load_chunk {
+	uint32_t start;
+	uint32_t end;
+	struct umidi20_track *track;
+};
+
+struct umidi20_load_work {
+	const uint8_t *ptr;
+	uint32_t len;
+	uint16_t num;
+	uint16_t next;
+	uint8_t	flags;
+	struct umidi20_load_chunk *chunk;
+};
+
+static void *
+umidi20_load_worker(void *arg)
+{
+	struct umidi20_load_work *work = arg;
+	struct umidi20_load_chunk *chunk;
+	struct midi_file in[1];
+	uint16_t n;
+
+	while ((n = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+	    work->num) {
+		chunk = &work->chunk[n];
+
+		in[0].ptr = (uint8_t *)(long)work->ptr;
+		in[0].end = work->len;
+		in[0].off = chunk->start;
+
+		chunk->track = umidi20_load_track(in, chunk->end, n);
+
+		/* free the events before the next track is loaded */
+		if (chunk->track != NULL && (work->flags & UMIDI20_LOAD_FLAG_PACK))
+			umidi20_track_pack(chunk->track);
+	}
+	return (NULL);
+}
+
+/*
+ * Parse all tracks located by the pre-scan. Returns non-zero if any
+ * track could not be parsed.
+ */
+static uint8_t
+umidi20_load_tracks(struct umidi20_load_work *work)
+{
+	pthread_t td[UMIDI20_LOAD_THREADS_MAX];
+	long ncpu;
+	uint16_t nthread = 0;
+	uint16_t x;
+
+	if (work->len >= UMIDI20_LOAD_PARALLEL_MIN && work->num > 1) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpu > UMIDI20_LOAD_THREADS_MAX)
+			ncpu = UMIDI20_LOAD_THREADS_MAX;
+		if (ncpu > work->num)
+			ncpu = work->num;
+
+		/* the calling thread is also a worker */
+		while (nthread + 1 < ncpu) {
+			if (pthread_create(&td[nthread], NULL,
+			    &umidi20_load_worker, work) != 0)
+				break;
+			nthread++;
+		}
+	}
+	umidi20_load_worker(work);
+
+	for (x = 0; x != nthread; x++)
+		pthread_join(td[x], NULL);
+
+	for (x = 0; x != work->num; x++) {
+		if (work->chunk[x].track == NULL)
+			return (1);
+	}
+	return (0);
+}
+
+struct umidi20_song *
+umidi20_load_file(pthread_mutex_t *p_mtx, const uint8_t *ptr, uint32_t len)
+{
+	return (umidi20_load_file_flags(p_mtx, ptr, len, 0));
+}
+
+struct umidi20_song *
+umidi20_load_file_flags(pthread_mutex_t *p_mtx, const uint8_t *ptr,
+    uint32_t len, uint8_t flags)
+{
+	struct midi_file in[1];
+	struct umidi20_load_work work;
+	struct umidi20_song *song = NULL;
+	uint32_t chunk_size;
+	uint32_t chunk_start;
+	uint16_t number_of_tracks;
+	uint16_t x;
+	uint8_t chunk_id[4];
+
+	memset(&work, 0, sizeof(work));
+
+	if (ptr == NULL || len == 0)
+		goto error;
+
+	/* init input file */
+	in[0].ptr = (uint8_t *)(long)ptr;
+	in[0].end = len;
+	in[0].off = 0;
+
+	song = umidi20_load_header(p_mtx, in, &number_of_tracks);
+
+	if (song == NULL)
+		goto error;
+
+	work.chunk = malloc(sizeof(work.chunk[0]) * (number_of_tracks + 1));
+
+	if (work.chunk == NULL)
+		goto error;
+
+	/* locate all the "MTrk" chunks */
+	while (work.num < number_of_tracks && midi_offset(in) != len) {
+
+		midi_read_multi(in, chunk_id, 4);
+
+		chunk_size = read_uint32(in);
+
+		chunk_start = midi_offset(in);
+
+		if (memcmp(chunk_id, "MTrk", 4) == 0) {
+			work.chunk[work.num].start = chunk_start;
+			work.chunk[work.num].end = chunk_start + chunk_size;
+			work.chunk[work.num].track = NULL;
+			work.num++;
 		}
 		/*
 		 * forwards compatibility:  skip over any unrecognized
@@ -521,60 +749,298 @@ umidi20_load_file(pthread_mutex_t *p_mtx, const uint8_t *ptr, uint32_t len)
 		midi_seek_set(in, chunk_start + chunk_size);
 	}
 
+	work.ptr = ptr;
+	work.len = len;
+	work.flags = flags;
+
+	if (umidi20_load_tracks(&work))
+		goto error;
+
+	/* add the tracks in file order */
+	for (x = 0; x != work.num; x++) {
+		umidi20_song_track_add(song, NULL, work.chunk[x].track, 0);
+		work.chunk[x].track = NULL;
+	}
+	free(work.chunk);
+
 	umidi20_song_recompute_position(song);
 	return (song);
 
 error:
+	for (x = 0; x != work.num; x++)
+		umidi20_track_free(work.chunk[x].track);
+	free(work.chunk);
 	umidi20_song_free(song);
-	umidi20_track_free(track);
-	umidi20_event_free(event);
 	return (NULL);
 }
 
+/*
+ * Read exactly "len" bytes, or skip them if "ptr" is NULL.
+ *
+ * Returns:
+ *    0: Success
+ * Else: Read error or end of file
+ */
+static uint8_t
+umidi20_load_read(int fd, void *ptr, uint32_t len)
+{
+	uint8_t temp[512];
+	ssize_t err;
+	uint32_t delta;
+
+	while (len != 0) {
+		delta = len;
+		if (ptr == NULL && delta > sizeof(temp))
+			delta = sizeof(temp);
+		err = read(fd, (ptr != NULL) ? ptr : temp, delta);
+		if (err <= 0)
+			return (1);
+		if (ptr != NULL)
+			ptr = (uint8_t *)ptr + err;
+		len -= err;
+	}
+	return (0);
+}
+
+/*
+ * Load a file chunk by chunk from a file descriptor which cannot be
+ * memory mapped, like a pipe. Only one "MTrk" chunk is buffered at
+ * a time.
+ */
+static struct umidi20_song *
+umidi20_load_file_stream(pthread_mutex_t *p_mtx, int fd, uint8_t flags)
+{
+	struct midi_file in[1];
+	struct umidi20_song *song = NULL;
+	struct umidi20_track *track;
+	uint8_t header[64];
+	uint8_t *buf = NULL;
+	uint32_t buf_max = 0;
+	uint32_t chunk_size;
+	uint32_t chunk_rem;
+	uint32_t off;
+	uint16_t number_of_tracks;
+	uint16_t number_of_tracks_read = 0;
+
+	/* read the header chunks into the header buffer */
+	if (umidi20_load_read(fd, header, 8))
+		goto error;
+	off = 8;
+
+	if (memcmp(header, "RIFF", 4) == 0) {
+		/* "RMID", "data" chunk header and "MThd" chunk header */
+		if (umidi20_load_read(fd, header + off, 20))
+			goto error;
+		off += 20;
+	}
+	chunk_size = interpret_uint32(header + off - 4);
+	chunk_rem = 0;
+	if (chunk_size > sizeof(header) - off) {
+		chunk_rem = chunk_size - (sizeof(header) - off);
+		chunk_size = sizeof(header) - off;
+	}
+	if (umidi20_load_read(fd, header + off, chunk_size))
+		goto error;
+	off += chunk_size;
+
+	/* forwards compatibility:  skip over any extra header data */
+	if (umidi20_load_read(fd, NULL, chunk_rem))
+		goto error;
+
+	in[0].ptr = header;
+	in[0].end = off;
+	in[0].off = 0;
+
+	song = umidi20_load_header(p_mtx, in, &number_of_tracks);
+
+	if (song == NULL)
+		goto error;
+
+	while (number_of_tracks_read < number_of_tracks) {
+
+		if (umidi20_load_read(fd, header, 8))
+			break;
+
+		chunk_size = interpret_uint32(header + 4);
+
+		if (memcmp(header, "MTrk", 4) != 0) {
+			/*
+			 * forwards compatibility:  skip over any
+			 * unrecognized chunks
+			 */
+			if (umidi20_load_read(fd, NULL, chunk_size))
+				break;
+			continue;
+		}
+		if (chunk_size > buf_max) {
+			free(buf);
+			buf_max = chunk_size;
+			buf = malloc(buf_max);
+			if (buf == NULL)
+				goto error;
+		}
+		if (umidi20_load_read(fd, buf, chunk_size))
+			break;
+
+		in[0].ptr = buf;
+		in[0].end = chunk_size;
+		in[0].off = 0;
+
+		track = umidi20_load_track(in, chunk_size, number_of_tracks_read);
+
+		if (track == NULL)
+			goto error;
+
+		if (flags & UMIDI20_LOAD_FLAG_PACK)
+			umidi20_track_pack(track);
+
+		number_of_tracks_read++;
+		umidi20_song_track_add(song, NULL, track, 0);
+	}
+	free(buf);
+
+	umidi20_song_recompute_position(song);
+	return (song);
+
+error:
+	free(buf);
+	umidi20_song_free(song);
+	return (NULL);
+}
+
+/*
+ * Load a MIDI file from a file descriptor. Regular files are memory
+ * mapped and parsed in place, without copying. Other files are read
+ * one chunk at a time.
+ */
+struct umidi20_song *
+umidi20_load_file_fd(pthread_mutex_t *p_mtx, int fd)
+{
+	return (umidi20_load_file_fd_flags(p_mtx, fd, 0));
+}
+
+struct umidi20_song *
+umidi20_load_file_fd_flags(pthread_mutex_t *p_mtx, int fd, uint8_t flags)
+{
+	struct umidi20_song *song;
+	struct stat st;
+	void *ptr;
+
+	if (fstat(fd, &st) != 0)
+		return (NULL);
+
+	if (!S_ISREG(st.st_mode) || st.st_size <= 0 ||
+	    (uint64_t)st.st_size > UINT32_MAX)
+		return (umidi20_load_file_stream(p_mtx, fd, flags));
+
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (ptr == MAP_FAILED)
+		return (umidi20_load_file_stream(p_mtx, fd, flags));
+
+	posix_madvise(ptr, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	song = umidi20_load_file_flags(p_mtx, ptr, st.st_size, flags);
+
+	munmap(ptr, st.st_size);
+
+	return (song);
+}
+
+/*
+ * Return the number of sub-millisecond tick bits to use when saving
+ * the given song. Sub-millisecond ticks are only used when asked for
+ * and when some event has a fractional position. Songs longer than
+ * the sub-millisecond ticks can represent are saved in milliseconds.
+ * Songs saved preserved keep their own resolution instead.
+ */
+static uint8_t
+umidi20_save_file_shift(struct umidi20_song *song, uint8_t flags)
+{
+	struct umidi20_track_iter iter;
+	struct umidi20_track *track;
+	struct umidi20_event *event;
+	uint8_t shift = 0;
+
+	if (!(flags & UMIDI20_SAVE_FLAG_FINE))
+		return (0);
+
+	UMIDI20_QUEUE_FOREACH(track, &(song->queue)) {
+		UMIDI20_TRACK_FOREACH(event, &iter, track) {
+			/* check for tick overflow */
+			if (event->position >=
+			    (1U << (32 - UMIDI20_FINE_TICK_SHIFT)))
+				return (0);
+			if (event->position_frac != 0)
+				shift = UMIDI20_FINE_TICK_SHIFT;
+		}
+	}
+	return (shift);
+}
+
 static uint8_t
 umidi20_save_file_sub(struct umidi20_song *song, struct midi_file *out)
 {
+	struct umidi20_track_iter iter;
 	struct umidi20_track *track;
 	struct umidi20_event *event;
-	struct umidi20_event *event_next;
 	uint32_t track_size_offset;
 	uint32_t track_start_offset;
 	uint32_t track_end_offset;
 	uint32_t tick;
 	uint32_t previous_tick;
 	uint32_t data_len;
+	uint64_t fine;
+	uint16_t resolution;
+	uint8_t division_type;
+	uint8_t shift;
+	uint8_t hdr[8];
 
 	if (song == NULL)
 		goto error;
 
 	pthread_mutex_assert(song->p_mtx, MA_OWNED);
 
-	umidi20_song_recompute_tick(song);
+	if (out->flags & UMIDI20_SAVE_FLAG_PRESERVE) {
+		/*
+		 * Compute the ticks from the positions using the tempo
+		 * map of the song while writing, keeping the tempo
+		 * events, so that the song is left as-is:
+		 */
+		if (umidi20_song_update_tempo_map(song))
+			goto error;
+		division_type = song->midi_division_type;
+		resolution = song->midi_resolution;
+	} else {
+		shift = umidi20_save_file_shift(song, out->flags);
+		umidi20_song_recompute_tick_shift(song, shift);
+		division_type = song->midi_division_type;
+		resolution = song->midi_resolution;
+	}
 
 	midi_write_multi(out, "MThd", 4);
 	write_uint32(out, 6);		/* header length */
 	write_uint16(out, song->midi_file_format);	/* file format */
 	write_uint16(out, song->queue.ifq_len);	/* number of tracks */
 
-	switch (song->midi_division_type) {
+	switch (division_type) {
 	case UMIDI20_FILE_DIVISION_TYPE_PPQ:
-		write_uint16(out, song->midi_resolution);
+		write_uint16(out, resolution);
 		break;
 	case UMIDI20_FILE_DIVISION_TYPE_SMPTE24:
 		midi_write_1(out, -24);
-		midi_write_1(out, song->midi_resolution);
+		midi_write_1(out, resolution);
 		break;
 	case UMIDI20_FILE_DIVISION_TYPE_SMPTE25:
 		midi_write_1(out, -25);
-		midi_write_1(out, song->midi_resolution);
+		midi_write_1(out, resolution);
 		break;
 	case UMIDI20_FILE_DIVISION_TYPE_SMPTE30DROP:
 		midi_write_1(out, -29);
-		midi_write_1(out, song->midi_resolution);
+		midi_write_1(out, resolution);
 		break;
 	case UMIDI20_FILE_DIVISION_TYPE_SMPTE30:
 		midi_write_1(out, -30);
-		midi_write_1(out, song->midi_resolution);
+		midi_write_1(out, resolution);
 		break;
 	default:
 		goto error;
@@ -582,18 +1048,25 @@ umidi20_save_file_sub(struct umidi20_song *song, struct midi_file *out)
 
 	UMIDI20_QUEUE_FOREACH(track, &(song->queue)) {
 
-		midi_write_multi(out, "MTrk", 4);
+		if (out->fd < 0) {
+			midi_write_multi(out, "MTrk", 4);
 
-		track_size_offset = midi_offset(out);
+			track_size_offset = midi_offset(out);
 
-		/* this field is written later */
-		write_uint32(out, 0);
+			/* this field is written later */
+			write_uint32(out, 0);
+		} else {
+			/* the chunk header is written along with the track */
+			if (midi_flush(out, NULL, 0))
+				goto error;
+			track_size_offset = 0;
+		}
 
 		track_start_offset = midi_offset(out);
 
 		previous_tick = 0;
 
-		UMIDI20_QUEUE_FOREACH_SAFE(event, &(track->queue), event_next) {
+		UMIDI20_TRACK_FOREACH(event, &iter, track) {
 			switch (event->cmd[1]) {
 			case 0xF4:
 			case 0xF5:
@@ -607,7 +1080,22 @@ umidi20_save_file_sub(struct umidi20_song *song, struct midi_file *out)
 			default:
 				break;
 			}
-			tick = event->tick;
+			if (out->flags & UMIDI20_SAVE_FLAG_PRESERVE) {
+				fine = ((uint64_t)event->position <<
+				    UMIDI20_POSITION_FINE_SHIFT) |
+				    event->position_frac;
+				/* keep the tick, unless the event was moved */
+				if (umidi20_song_tick_to_position_fine(song,
+				    event->tick) == fine)
+					tick = event->tick;
+				else
+					tick = umidi20_song_position_fine_to_tick(
+					    song, fine);
+				if (tick < previous_tick)
+					tick = previous_tick;
+			} else {
+				tick = event->tick;
+			}
 			write_variable_length_quantity(out, tick - previous_tick);
 			previous_tick = tick;
 
@@ -664,8 +1152,8 @@ umidi20_save_file_sub(struct umidi20_song *song, struct midi_file *out)
 					midi_write_1(out, 0xFF);
 					midi_write_1(out, event->cmd[2] & 0x7F);
 					data_len = umidi20_event_get_length(event);
-					write_variable_length_quantity(out, data_len - 1);
-					write_event(event, out, 1, data_len - 1);
+					write_variable_length_quantity(out, data_len - 2);
+					write_event(event, out, 2, data_len - 2);
 					break;
 				default:
 					midi_write_1(out, 0xFE);	/* dummy */
@@ -684,12 +1172,27 @@ umidi20_save_file_sub(struct umidi20_song *song, struct midi_file *out)
 
 		track_end_offset = midi_offset(out);
 
-		midi_seek_set(out, track_size_offset);
+		if (out->fd < 0) {
+			midi_seek_set(out, track_size_offset);
+
+			write_uint32(out, track_end_offset - track_start_offset);
 
-		write_uint32(out, track_end_offset - track_start_offset);
+			midi_seek_set(out, track_end_offset);
+		} else {
+			memcpy(hdr, "MTrk", 4);
+			hdr[4] = (track_end_offset >> 24);
+			hdr[5] = (track_end_offset >> 16) & 0xFF;
+			hdr[6] = (track_end_offset >> 8) & 0xFF;
+			hdr[7] = (track_end_offset & 0xFF);
 
-		midi_seek_set(out, track_end_offset);
+			if (midi_flush(out, hdr, 8))
+				goto error;
+		}
 	}
+	if (out->fd > -1 && midi_flush(out, NULL, 0))
+		goto error;
+	if (out->error != 0)
+		goto error;
 	return (0);
 
 error:
@@ -699,28 +1202,56 @@ error:
 /* Must be called having the song locked. */
 uint8_t
 umidi20_save_file(struct umidi20_song *song, uint8_t **pptr, uint32_t *plen)
+{
+	return (umidi20_save_file_flags(song, pptr, plen, 0));
+}
+
+uint8_t
+umidi20_save_file_flags(struct umidi20_song *song, uint8_t **pptr,
+    uint32_t *plen, uint8_t flags)
 {
 	struct midi_file out;
-	uint32_t len;
 
 	out.ptr = NULL;
-	out.end = -1U;
+	out.end = 0;
 	out.off = 0;
+	out.fd = -1;
+	out.grow = 1;
+	out.flags = flags;
+	out.error = 0;
 
-	if (umidi20_save_file_sub(song, &out))
+	if (umidi20_save_file_sub(song, &out)) {
+		free(out.ptr);
 		return (1);
+	}
 
-	len = out.off;
+	*pptr = out.ptr;
+	*plen = out.off;
 
-	*pptr = out.ptr = malloc(len);
-	*plen = out.end = len;
+	return (0);
+}
 
-	if (out.ptr == NULL)
-		return (1);
+/*
+ * Save a MIDI file to a file descriptor. Only one track is buffered
+ * at a time.
+ */
+uint8_t
+umidi20_save_file_fd(struct umidi20_song *song, int fd, uint8_t flags)
+{
+	struct midi_file out;
+	uint8_t retval;
 
+	out.ptr = NULL;
+	out.end = 0;
 	out.off = 0;
+	out.fd = fd;
+	out.grow = 1;
+	out.flags = flags;
+	out.error = 0;
 
-	umidi20_save_file_sub(song, &out);
+	retval = umidi20_save_file_sub(song, &out);
 
-	return (0);
+	free(out.ptr);
+
+	return (retval);
 }
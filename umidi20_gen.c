@@ -71,10 +71,38 @@ mid_set_device_no(struct mid_data *d, uint8_t device_no)
 	else
 		enable = 1;
 
+	mid_flush(d);
+
 	d->cc_enabled = enable;
 	d->cc_device_no = device_no;
 }
 
+/*
+ * When enabled, carbon copy events are collected and only queued for
+ * playback when mid_flush() is called, which takes the root device
+ * lock once for all of them.
+ */
+void
+mid_set_batch(struct mid_data *d, uint8_t enable)
+{
+	if (enable == 0)
+		mid_flush(d);
+
+	d->cc_batch = (enable != 0);
+}
+
+void
+mid_flush(struct mid_data *d)
+{
+	if (d->cc_queue.ifq_head == NULL)
+		return;
+
+	if (d->cc_enabled)
+		umidi20_put_queue_batch(d->cc_device_no, &d->cc_queue);
+	else
+		umidi20_event_queue_drain(&d->cc_queue);
+}
+
 void
 mid_sort(uint8_t *pk, uint8_t nk)
 {
@@ -181,6 +209,11 @@ mid_dump(struct mid_data *d)
 	uint8_t new_pedal;
 	uint8_t pedal_down = 0;
 
+	/* the note durations are only computed for unpacked tracks */
+	if (umidi20_track_unpack(d->track)) {
+		printf("Cannot dump track: Out of memory\n");
+		return;
+	}
 	umidi20_track_compute_max_min(d->track);
 
 	UMIDI20_QUEUE_FOREACH(event, &(d->track->queue)) {
@@ -232,19 +265,27 @@ mid_add_raw(struct mid_data *d, const uint8_t *buf,
 		/* set channel, if any */
 		umidi20_event_set_channel(event, d->channel);
 
-		if (d->cc_enabled) {
+		if (d->cc_enabled && d->cc_batch) {
+			umidi20_event_queue_insert(&d->cc_queue,
+			    event, UMIDI20_CACHE_INPUT);
+		} else if (d->cc_enabled) {
 			/*
-			 * Need to lock the root device before adding
+			 * Need to lock the device before adding
 			 * entries to the play queue:
 			 */
-			pthread_mutex_lock(&(root_dev.mutex));
+			pthread_mutex_lock(&(root_dev.play[d->cc_device_no].mtx));
 			umidi20_event_queue_insert(&(root_dev.play[d->cc_device_no].queue),
 			    event, UMIDI20_CACHE_INPUT);
-			pthread_mutex_unlock(&(root_dev.mutex));
+			if (root_dev.play[d->cc_device_no].queue.ifq_head == event)
+				umidi20_wakeup();
+			pthread_mutex_unlock(&(root_dev.play[d->cc_device_no].mtx));
 
-		} else {
+		} else if (umidi20_track_unpack(d->track) == 0) {
 			umidi20_event_queue_insert(&d->track->queue,
 			    event, UMIDI20_CACHE_INPUT);
+		} else {
+			umidi20_event_free(event);
+			printf("Lost event: Out of memory\n");
 		}
 
 	} else {
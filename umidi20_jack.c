@@ -64,6 +64,10 @@ struct umidi20_jack {
 	char   *read_name;
 	char   *write_name;
 	struct umidi20_parse parse;
+	uint8_t	tx_data[64];		/* bytes not yet parsed */
+	uint64_t tx_ts[64];		/* timestamps of the bytes */
+	uint8_t	tx_off;
+	uint8_t	tx_len;
 };
 
 static pthread_mutex_t umidi20_jack_mtx;
@@ -91,8 +95,36 @@ umidi20_jack_unlock(void)
 	pthread_mutex_unlock(&umidi20_jack_mtx);
 }
 
+/*
+ * Convert a number of frames into fine position units.
+ */
+static uint64_t
+umidi20_jack_frames_to_fine(uint64_t frames, jack_nframes_t rate)
+{
+	return (((frames << UMIDI20_POSITION_FINE_SHIFT) * 1000) / rate);
+}
+
+/*
+ * Convert a fine position into a frame offset within the current
+ * period. The "origin" argument is the fine position of frame zero.
+ */
+static jack_nframes_t
+umidi20_jack_fine_to_frame(uint64_t ts, uint64_t origin,
+    jack_nframes_t rate, jack_nframes_t nframes)
+{
+	uint64_t frames;
+
+	if (ts <= origin)
+		return (0);
+	frames = ((ts - origin) * rate) / (1000 << UMIDI20_POSITION_FINE_SHIFT);
+	if (frames >= nframes)
+		return (nframes - 1);
+	return (frames);
+}
+
 static void
-umidi20_jack_write(struct umidi20_jack *puj, jack_nframes_t nframes)
+umidi20_jack_write(struct umidi20_jack *puj, jack_nframes_t nframes,
+    uint64_t origin, jack_nframes_t rate)
 {
 	int error;
 	int events;
@@ -131,9 +163,8 @@ umidi20_jack_write(struct umidi20_jack *puj, jack_nframes_t nframes)
 			continue;
 		}
 
-		umidi20_jack_lock();
-		umidi20_pipe_write_data(&puj->write_fd, event.buffer, event.size);
-		umidi20_jack_unlock();
+		umidi20_pipe_write_data_ts(&puj->write_fd, event.buffer, event.size,
+		    origin + umidi20_jack_frames_to_fine(event.time, rate));
 	}
 }
 
@@ -292,12 +323,14 @@ umidi20_convert_to_usb(struct umidi20_jack *puj, uint8_t cn, uint8_t b)
 }
 
 static void
-umidi20_jack_read(struct umidi20_jack *puj, jack_nframes_t nframes)
+umidi20_jack_read(struct umidi20_jack *puj, jack_nframes_t nframes,
+    uint64_t origin, jack_nframes_t rate)
 {
 	uint8_t *buffer;
 	void *buf;
+	jack_nframes_t frame;
 	jack_nframes_t t;
-	uint8_t data[1];
+	ssize_t num;
 	uint8_t len;
 
 	if (puj->output_port == NULL)
@@ -321,28 +354,49 @@ umidi20_jack_read(struct umidi20_jack *puj, jack_nframes_t nframes)
 	jack_midi_clear_buffer(buf);
 #endif
 
+	/*
+	 * The mutex is only held while opening and closing the
+	 * device. Never block the realtime thread on it, but try
+	 * again next period.
+	 */
+	if (pthread_mutex_trylock(&umidi20_jack_mtx) != 0)
+		return;
+
 	t = 0;
-	umidi20_jack_lock();
-	while ((t < nframes) &&
-	    (umidi20_pipe_read_data(&puj->read_fd, data, sizeof(data)) == sizeof(data))) {
-		if (umidi20_convert_to_usb(puj, 0, data[0])) {
+	while (1) {
+		/* refill the local buffer in bulk */
+		if (puj->tx_off == puj->tx_len) {
+			num = umidi20_pipe_read_data_ts(&puj->read_fd,
+			    puj->tx_data, puj->tx_ts, sizeof(puj->tx_data));
+			if (num <= 0)
+				break;
+			puj->tx_off = 0;
+			puj->tx_len = num;
+		}
+		if (!umidi20_convert_to_usb(puj, 0, puj->tx_data[puj->tx_off++]))
+			continue;
+
+		len = umidi20_cmd_to_len[puj->parse.temp_cmd[0] & 0xF];
+		if (len == 0)
+			continue;
 
-			len = umidi20_cmd_to_len[puj->parse.temp_cmd[0] & 0xF];
-			if (len == 0)
-				continue;
+		/* event times must not decrease */
+		frame = umidi20_jack_fine_to_frame(
+		    puj->tx_ts[puj->tx_off - 1], origin, rate, nframes);
+		if (frame > t)
+			t = frame;
 #ifdef JACK_MIDI_NEEDS_NFRAMES
-			buffer = jack_midi_event_reserve(buf, t, len, nframes);
+		buffer = jack_midi_event_reserve(buf, t, len, nframes);
 #else
-			buffer = jack_midi_event_reserve(buf, t, len);
+		buffer = jack_midi_event_reserve(buf, t, len);
 #endif
-			if (buffer == NULL) {
-				DPRINTF("jack_midi_event_reserve() failed, "
-				    "MIDI event lost\n");
-				break;
-			}
-			memcpy(buffer, &puj->parse.temp_cmd[1], len);
-			t++;
+		if (buffer == NULL) {
+			/* keep the remaining bytes for the next period */
+			DPRINTF("jack_midi_event_reserve() failed, "
+			    "MIDI event lost\n");
+			break;
 		}
+		memcpy(buffer, &puj->parse.temp_cmd[1], len);
 	}
 	umidi20_jack_unlock();
 }
@@ -350,6 +404,8 @@ umidi20_jack_read(struct umidi20_jack *puj, jack_nframes_t nframes)
 static int
 umidi20_process_callback(jack_nframes_t nframes, void *reserved)
 {
+	jack_nframes_t rate;
+	uint64_t origin;
 	uint8_t n;
 
 	/*
@@ -360,9 +416,20 @@ umidi20_process_callback(jack_nframes_t nframes, void *reserved)
 		DPRINTF("Process callback called with nframes = 0\n");
 		return (0);
 	}
+
+	/*
+	 * Map frame zero to one period before the start of the
+	 * current cycle. Received events were captured during the
+	 * previous period and transmitted events are delayed by one
+	 * period, so that they can be placed at the correct frame.
+	 */
+	rate = jack_get_sample_rate(umidi20_jack_client);
+	origin = umidi20_get_curr_position_fine() - umidi20_jack_frames_to_fine(
+	    (uint64_t)jack_frames_since_cycle_start(umidi20_jack_client) + nframes, rate);
+
 	for (n = 0; n != UMIDI20_N_DEVICES; n++) {
-		umidi20_jack_read(umidi20_jack + n, nframes);
-		umidi20_jack_write(umidi20_jack + n, nframes);
+		umidi20_jack_read(umidi20_jack + n, nframes, origin, rate);
+		umidi20_jack_write(umidi20_jack + n, nframes, origin, rate);
 	}
 	return (0);
 }
@@ -453,7 +520,7 @@ umidi20_jack_rx_open(uint8_t n, const char *name)
 
 	/* create looback pipe */
 	umidi20_jack_lock();
-	umidi20_pipe_alloc(&puj->write_fd, NULL);
+	umidi20_pipe_alloc(&puj->write_fd, &umidi20_wakeup);
 	umidi20_jack_unlock();
 
 	return (&puj->write_fd);
@@ -493,6 +560,8 @@ umidi20_jack_tx_open(uint8_t n, const char *name)
 	umidi20_jack_lock();
 	umidi20_pipe_alloc(&puj->read_fd, NULL);
 	memset(&puj->parse, 0, sizeof(puj->parse));
+	puj->tx_off = 0;
+	puj->tx_len = 0;
 	umidi20_jack_unlock();
 
 	return (&puj->read_fd);
@@ -33,21 +33,40 @@
 
 #include "umidi20.h"
 
-#define	UMIDI20_PIPE_MAX 1024		/* bytes */
-
+#define	UMIDI20_PIPE_MAX 1024		/* bytes, power of two */
+
+/*
+ * Each pipe is a lock-free ring buffer having one producer and one
+ * consumer. Multiple writers or readers of the same pipe must be
+ * serialized by the caller. The "consumer" and "producer" counters
+ * are free running and are only updated by the reader and the writer
+ * respectively.
+ *
+ * Pipes are never returned to the heap, but are recycled through a
+ * free list, so that a reader or writer racing umidi20_pipe_free()
+ * only touches valid memory. The "refs" field counts the readers and
+ * writers currently accessing the pipe.
+ *
+ * Every byte carries a timestamp in fine position units, see
+ * umidi20_get_curr_position_fine().
+ */
 struct umidi20_pipe {
 	uint8_t	data[UMIDI20_PIPE_MAX];
+	uint64_t ts[UMIDI20_PIPE_MAX];
 	size_t	consumer;
-	size_t	total;
+	size_t	producer;
 	umidi20_pipe_callback_t *fn;
+	struct umidi20_pipe *next;
+	uint32_t refs;
 };
 
-static pthread_mutex_t umidi20_pipe_mtx;
+static pthread_mutex_t umidi20_pipe_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct umidi20_pipe *umidi20_pipe_free_list;
 
 void
 umidi20_pipe_init(void)
 {
-	pthread_mutex_init(&umidi20_pipe_mtx, NULL);
+	/* the mutex is statically initialized */
 }
 
 void
@@ -55,11 +74,22 @@ umidi20_pipe_alloc(struct umidi20_pipe **pipe, umidi20_pipe_callback_t *fn)
 {
 	struct umidi20_pipe *temp;
 
-	temp = calloc(1, sizeof(*temp));
+	pthread_mutex_lock(&umidi20_pipe_mtx);
+	temp = umidi20_pipe_free_list;
+	if (temp != NULL)
+		umidi20_pipe_free_list = temp->next;
+	pthread_mutex_unlock(&umidi20_pipe_mtx);
+
+	if (temp == NULL)
+		temp = calloc(1, sizeof(*temp));
+
+	temp->consumer = 0;
+	temp->producer = 0;
 	temp->fn = fn;
+	temp->next = NULL;
 
 	pthread_mutex_lock(&umidi20_pipe_mtx);
-	*pipe = temp;
+	__atomic_store_n(pipe, temp, __ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&umidi20_pipe_mtx);
 }
 
@@ -70,106 +100,143 @@ umidi20_pipe_free(struct umidi20_pipe **pipe)
 
 	pthread_mutex_lock(&umidi20_pipe_mtx);
 	temp = *pipe;
-	*pipe = NULL;
+	__atomic_store_n(pipe, NULL, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&umidi20_pipe_mtx);
+
+	if (temp == NULL)
+		return;
+
+	/* wait for the reader and the writer to leave */
+	while (__atomic_load_n(&temp->refs, __ATOMIC_SEQ_CST) != 0)
+		usleep(1000);
+
+	pthread_mutex_lock(&umidi20_pipe_mtx);
+	temp->next = umidi20_pipe_free_list;
+	umidi20_pipe_free_list = temp;
 	pthread_mutex_unlock(&umidi20_pipe_mtx);
-	free(temp);
+}
+
+/*
+ * Returns a referenced pipe or NULL if the pipe is closed.
+ */
+static struct umidi20_pipe *
+umidi20_pipe_acquire(struct umidi20_pipe **pp)
+{
+	struct umidi20_pipe *pipe;
+
+	pipe = __atomic_load_n(pp, __ATOMIC_SEQ_CST);
+	if (pipe == NULL)
+		return (NULL);
+
+	__atomic_add_fetch(&pipe->refs, 1, __ATOMIC_SEQ_CST);
+
+	/* check that the pipe was not freed in the meantime */
+	if (__atomic_load_n(pp, __ATOMIC_SEQ_CST) != pipe) {
+		__atomic_sub_fetch(&pipe->refs, 1, __ATOMIC_SEQ_CST);
+		return (NULL);
+	}
+	return (pipe);
+}
+
+static void
+umidi20_pipe_release(struct umidi20_pipe *pipe)
+{
+	__atomic_sub_fetch(&pipe->refs, 1, __ATOMIC_SEQ_CST);
 }
 
 ssize_t
 umidi20_pipe_read_data(struct umidi20_pipe **pp, uint8_t *dst, size_t num)
+{
+	return (umidi20_pipe_read_data_ts(pp, dst, NULL, num));
+}
+
+ssize_t
+umidi20_pipe_read_data_ts(struct umidi20_pipe **pp, uint8_t *dst,
+    uint64_t *ts, size_t num)
 {
 	struct umidi20_pipe *pipe;
-	uint8_t *old;
+	size_t consumer;
+	size_t offset;
+	size_t total;
 	size_t fwd;
 
-	pthread_mutex_lock(&umidi20_pipe_mtx);
-
-	pipe = *pp;
-	if (pipe == NULL) {
-		old = dst + 1;
-		goto done;
-	}
+	pipe = umidi20_pipe_acquire(pp);
+	if (pipe == NULL)
+		return (-1);
 
-	old = dst;
-	fwd = UMIDI20_PIPE_MAX - pipe->consumer;
+	consumer = pipe->consumer;
+	total = __atomic_load_n(&pipe->producer, __ATOMIC_ACQUIRE) - consumer;
 
 	/* check for maximum amount of data that can be removed */
-	if (num > pipe->total)
-		num = pipe->total;
+	if (num > total)
+		num = total;
 
 	/* copy samples from ring-buffer */
-	while (num != 0) {
-		if (fwd > num)
-			fwd = num;
-		memcpy(dst, pipe->data + pipe->consumer, sizeof(pipe->data[0]) * fwd);
-		dst += fwd;
-		num -= fwd;
-		pipe->consumer += fwd;
-		pipe->total -= fwd;
-		if (pipe->consumer == UMIDI20_PIPE_MAX) {
-			pipe->consumer = 0;
-			fwd = UMIDI20_PIPE_MAX;
-		} else {
-			break;
-		}
+	offset = consumer & (UMIDI20_PIPE_MAX - 1);
+	fwd = UMIDI20_PIPE_MAX - offset;
+	if (fwd > num)
+		fwd = num;
+	memcpy(dst, pipe->data + offset, sizeof(pipe->data[0]) * fwd);
+	memcpy(dst + fwd, pipe->data, sizeof(pipe->data[0]) * (num - fwd));
+	if (ts != NULL) {
+		memcpy(ts, pipe->ts + offset, sizeof(pipe->ts[0]) * fwd);
+		memcpy(ts + fwd, pipe->ts, sizeof(pipe->ts[0]) * (num - fwd));
 	}
-done:
-	pthread_mutex_unlock(&umidi20_pipe_mtx);
-	return (dst - old);
+
+	__atomic_store_n(&pipe->consumer, consumer + num, __ATOMIC_RELEASE);
+
+	umidi20_pipe_release(pipe);
+
+	return (num);
 }
 
 ssize_t
 umidi20_pipe_write_data(struct umidi20_pipe **pp, const uint8_t *src, size_t num)
+{
+	return (umidi20_pipe_write_data_ts(pp, src, num,
+	    umidi20_get_curr_position_fine()));
+}
+
+ssize_t
+umidi20_pipe_write_data_ts(struct umidi20_pipe **pp, const uint8_t *src,
+    size_t num, uint64_t ts)
 {
 	struct umidi20_pipe *pipe;
 	umidi20_pipe_callback_t *fn;
-	ssize_t retval;
 	size_t producer;
-	size_t fwd;
+	size_t offset;
 	size_t max;
+	size_t fwd;
+	size_t x;
+
+	pipe = umidi20_pipe_acquire(pp);
+	if (pipe == NULL)
+		return (-1);
 
-	pthread_mutex_lock(&umidi20_pipe_mtx);
-	pipe = *pp;
-	if (pipe == NULL) {
-		fn = NULL;
-		retval = -1;
-		goto done;
-	}
 	fn = pipe->fn;
-	producer = (pipe->consumer + pipe->total) % UMIDI20_PIPE_MAX;
-	fwd = UMIDI20_PIPE_MAX - producer;
-	max = UMIDI20_PIPE_MAX - pipe->total;
+	producer = pipe->producer;
+	max = UMIDI20_PIPE_MAX -
+	    (producer - __atomic_load_n(&pipe->consumer, __ATOMIC_ACQUIRE));
 
 	if (num > max)
 		num = max;
 
-	retval = num;
-
 	/* copy samples to ring-buffer */
-	while (num != 0) {
-		if (fwd > num)
-			fwd = num;
-		if (fwd != 0) {
-			memcpy(pipe->data + producer, src, sizeof(pipe->data[0]) * fwd);
-
-			/* update last sample */
-			src += fwd;
-			num -= fwd;
-			pipe->total += fwd;
-			producer += fwd;
-		}
-		if (producer == UMIDI20_PIPE_MAX) {
-			producer = 0;
-			fwd = UMIDI20_PIPE_MAX;
-		} else {
-			break;
-		}
-	}
-done:
-	pthread_mutex_unlock(&umidi20_pipe_mtx);
+	offset = producer & (UMIDI20_PIPE_MAX - 1);
+	fwd = UMIDI20_PIPE_MAX - offset;
+	if (fwd > num)
+		fwd = num;
+	memcpy(pipe->data + offset, src, sizeof(pipe->data[0]) * fwd);
+	memcpy(pipe->data, src + fwd, sizeof(pipe->data[0]) * (num - fwd));
+	for (x = 0; x != num; x++)
+		pipe->ts[(producer + x) & (UMIDI20_PIPE_MAX - 1)] = ts;
+
+	__atomic_store_n(&pipe->producer, producer + num, __ATOMIC_RELEASE);
+
+	umidi20_pipe_release(pipe);
 
 	if (fn != NULL)
 		(fn) ();
 
-	return (retval);
+	return (num);
 }